@@ -0,0 +1,323 @@
+#pragma once
+#include "image.h"
+#include "input.h"
+#include "options.h"
+#include "render.h"
+#include "threadpool.h"
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Frame sequence sidecar. Each `frame` line starts a new frame that inherits everything from
+// the one before it; the lines after it change that state:
+//   eye X Y Z | viewdir X Y Z | updir X Y Z | hfov DEG   camera
+//   light I X Y Z                                         position (or direction) of light I
+//   lightcolor I R G B                                    color of light I
+//   translate I[-J] DX DY DZ                              offset of objects I..J from where the
+//                                                         scene file puts them
+// Lights and objects are numbered from 0 in scene file order; spheres and faces share one
+// numbering, so a mesh is moved with a range.
+struct AnimationFrame
+{
+    ViewOverride view;
+    std::map<int, Point> light_pos;
+    std::map<int, Color> light_color;
+    std::map<int, Vec3> offsets;
+};
+
+// `initial` is the command line view the first frame starts from
+std::vector<AnimationFrame> read_animation(const std::string &path, const InputFileData &input, const ViewOverride &initial)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Unable to open file " << path << std::endl;
+        exit(1);
+    }
+    std::vector<AnimationFrame> frames;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line))
+    {
+        line_number++;
+        std::istringstream iss(line);
+        std::string key;
+        if (!(iss >> key) || key[0] == '#')
+        {
+            continue;
+        }
+        auto fail = [&](const char *what)
+        {
+            std::cerr << path << ":" << line_number << ": " << what << std::endl;
+            exit(1);
+        };
+        if (key == "frame")
+        {
+            if (frames.empty())
+            {
+                AnimationFrame first;
+                first.view = initial;
+                frames.push_back(first);
+            }
+            else
+            {
+                frames.push_back(frames.back());
+            }
+            continue;
+        }
+        if (frames.empty())
+        {
+            fail("expected frame");
+        }
+        AnimationFrame &frame = frames.back();
+        ViewOverride &view = frame.view;
+        if (key == "eye" || key == "viewdir" || key == "updir")
+        {
+            double *v = key == "eye" ? view.eye : key == "viewdir" ? view.viewdir : view.updir;
+            if (!(iss >> v[0] >> v[1] >> v[2]))
+            {
+                fail("invalid vector");
+            }
+            view.fields |= key == "eye" ? VIEW_EYE : key == "viewdir" ? VIEW_VIEWDIR : VIEW_UPDIR;
+        }
+        else if (key == "hfov")
+        {
+            if (!(iss >> view.hfov))
+            {
+                fail("invalid hfov");
+            }
+            view.fields |= VIEW_HFOV;
+        }
+        else if (key == "light" || key == "lightcolor")
+        {
+            int index;
+            Real x, y, z;
+            if (!(iss >> index >> x >> y >> z) || index < 0 || index >= (int)input.lights.size())
+            {
+                fail("invalid light");
+            }
+            if (key == "light")
+            {
+                frame.light_pos[index] = Point(x, y, z);
+            }
+            else
+            {
+                frame.light_color[index] = Color(x, y, z);
+            }
+        }
+        else if (key == "translate")
+        {
+            std::string range;
+            Real x, y, z;
+            int first, last;
+            if (!(iss >> range >> x >> y >> z))
+            {
+                fail("invalid translate");
+            }
+            int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (n == 1)
+            {
+                last = first;
+            }
+            if (n < 1 || first < 0 || last < first || last >= (int)input.objects.size())
+            {
+                fail("invalid object range");
+            }
+            for (int i = first; i <= last; i++)
+            {
+                frame.offsets[i] = Vec3(x, y, z);
+            }
+        }
+        else
+        {
+            fail("unknown key");
+        }
+    }
+    if (frames.empty())
+    {
+        std::cerr << path << ": no frames" << std::endl;
+        exit(1);
+    }
+    return frames;
+}
+
+// Moves the scene from frame to frame. Object positions are always set from a snapshot of the
+// scene as parsed, so offsets do not drift, and the BVH is refit instead of rebuilt.
+class Animation
+{
+public:
+    explicit Animation(InputFileData &input) : input(input), base_lights(input.lights)
+    {
+        for (auto &object : input.objects)
+        {
+            if (object->type == ObjectType::SPHERE)
+            {
+                base_positions.push_back({static_cast<Sphere &>(*object).pos});
+            }
+            else if (object->type == ObjectType::INSTANCE)
+            {
+                base_positions.push_back({static_cast<Instance &>(*object).to_world.Translation()});
+            }
+            else
+            {
+                auto &face = static_cast<Face &>(*object);
+                base_positions.push_back({face.v0.pos, face.v1.pos, face.v2.pos});
+            }
+        }
+    }
+    void Apply(const AnimationFrame &frame)
+    {
+        input.lights = base_lights;
+        for (const auto &[index, pos] : frame.light_pos)
+        {
+            input.lights[index].pos = pos;
+        }
+        for (const auto &[index, color] : frame.light_color)
+        {
+            input.lights[index].color = color;
+        }
+        build_light_grid(input);
+        if (frame.offsets == applied)
+        {
+            return;
+        }
+        // objects that moved last frame go back to the scene file position unless moved again
+        for (const auto &[index, offset] : applied)
+        {
+            if (!frame.offsets.count(index))
+            {
+                place(index, Vec3(0, 0, 0));
+            }
+        }
+        for (const auto &[index, offset] : frame.offsets)
+        {
+            place(index, offset);
+        }
+        applied = frame.offsets;
+        input.bvh.Refit();
+    }
+
+private:
+    void place(int index, const Vec3 &offset)
+    {
+        Object &object = *input.objects[index];
+        const auto &base = base_positions[index];
+        if (object.type == ObjectType::SPHERE)
+        {
+            static_cast<Sphere &>(object).pos = base[0] + offset;
+        }
+        else if (object.type == ObjectType::INSTANCE)
+        {
+            auto &instance = static_cast<Instance &>(object);
+            instance.Translate(base[0] + offset - instance.to_world.Translation());
+        }
+        else
+        {
+            auto &face = static_cast<Face &>(object);
+            face.v0.pos = base[0] + offset;
+            face.v1.pos = base[1] + offset;
+            face.v2.pos = base[2] + offset;
+        }
+    }
+    InputFileData &input;
+    std::vector<Light> base_lights;
+    std::vector<std::vector<Point>> base_positions;
+    std::map<int, Vec3> applied;
+};
+
+// Saves finished frames on a background thread so disk output overlaps the next render. At
+// most kMaxQueued frames wait to be written; Submit blocks beyond that to bound memory.
+class FrameWriter
+{
+public:
+    static constexpr size_t kMaxQueued = 2;
+
+    FrameWriter() : thread(&FrameWriter::run, this) {}
+    ~FrameWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        changed.notify_all();
+        thread.join();
+    }
+    FrameWriter(const FrameWriter &) = delete;
+    FrameWriter &operator=(const FrameWriter &) = delete;
+
+    void Submit(std::unique_ptr<Image> image, const std::string &name)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]
+                     { return queue.size() < kMaxQueued; });
+        queue.push_back({std::move(image), name});
+        changed.notify_all();
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]
+                         { return done || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            auto job = std::move(queue.front());
+            lock.unlock();
+            job.first->save(job.second);
+            std::cout << "Image saved to " << job.second << std::endl;
+            lock.lock();
+            queue.pop_front();
+            changed.notify_all();
+        }
+    }
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::pair<std::unique_ptr<Image>, std::string>> queue;
+    bool done = false;
+    std::thread thread;
+};
+
+// Render every frame of the sidecar with the scene, thread pool and texture cache loaded once.
+// Frames go to <base>_0000<extension>, <base>_0001<extension>, ..., see Image::save for the
+// formats.
+int RunAnimation(const std::string &path, const std::string &base, const std::string &extension,
+                 const ViewOverride &view_override, InputFileData &input, ThreadPool &pool)
+{
+    auto frames = read_animation(path, input, view_override);
+    Animation animation(input);
+    FrameWriter writer;
+    for (size_t n = 0; n < frames.size(); n++)
+    {
+        animation.Apply(frames[n]);
+        auto view = ResolveView(input, frames[n].view);
+        if (!view)
+        {
+            std::cerr << "Invalid view in frame " << n << std::endl;
+            return 1;
+        }
+        auto image = std::make_unique<Image>(view->region.Width(), view->region.Height());
+        image->origin_x = view->region.x0;
+        image->origin_y = view->region.y0;
+        image->fill(input.bkgcolor);
+        RenderRegion(input, view->camera, view->region, *image, pool);
+        // room for "_" and every digit of a size_t
+        char suffix[24];
+        std::snprintf(suffix, sizeof(suffix), "_%04zu", n);
+        writer.Submit(std::move(image), base + suffix + extension);
+    }
+    return 0;
+}
@@ -0,0 +1,227 @@
+#pragma once
+#include "mathUtil.h"
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+class Object;
+
+struct AABB
+{
+    Point min{std::numeric_limits<Real>::infinity(), std::numeric_limits<Real>::infinity(), std::numeric_limits<Real>::infinity()};
+    Point max{-std::numeric_limits<Real>::infinity(), -std::numeric_limits<Real>::infinity(), -std::numeric_limits<Real>::infinity()};
+
+    void Grow(const Point &p)
+    {
+        min = Point(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Point(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+    void Grow(const AABB &box)
+    {
+        Grow(box.min);
+        Grow(box.max);
+    }
+    Point Center() const
+    {
+        return (min + max) * Real(0.5);
+    }
+    bool Empty() const
+    {
+        return min.x > max.x;
+    }
+    // slab test against [t_min, t_max]; NaNs from axis-parallel rays on a slab plane count as inside
+    bool Hit(const Point &origin, const Vec3 &inv_dir, Real t_min, Real t_max) const
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            Real t0 = ((&min.x)[axis] - (&origin.x)[axis]) * (&inv_dir.x)[axis];
+            Real t1 = ((&max.x)[axis] - (&origin.x)[axis]) * (&inv_dir.x)[axis];
+            if (t0 > t1)
+            {
+                std::swap(t0, t1);
+            }
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_min > t_max)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// defined next to the object types in input.h
+AABB ObjectBounds(const Object &object);
+
+// box of a BVH primitive; other primitive types overload this next to their definition
+inline AABB PrimitiveBounds(const Object *object)
+{
+    return ObjectBounds(*object);
+}
+
+// Bounding volume hierarchy over pointers to primitives, the scene objects unless stated
+// otherwise. Nodes are stored depth first, so a node's left child directly follows it and
+// every child comes after its parent; Refit relies on that to update bounds in a single
+// reverse sweep when objects move without changing topology. Leaves are stored depth first
+// too, so consecutive leaves are spatially close.
+template <typename Prim>
+class BasicBVH
+{
+public:
+    static constexpr int kLeafSize = 4;
+
+    void Build(const std::vector<Prim> &objects, int max_leaf_size = kLeafSize)
+    {
+        prims = objects;
+        nodes.clear();
+        leaf_size = max_leaf_size;
+        if (prims.empty())
+        {
+            return;
+        }
+        std::vector<AABB> bounds(prims.size());
+        for (size_t i = 0; i < prims.size(); i++)
+        {
+            bounds[i] = PrimitiveBounds(prims[i]);
+        }
+        std::vector<int> order(prims.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = (int)i;
+        }
+        nodes.reserve(2 * prims.size());
+        build(bounds, order, 0, (int)order.size());
+        std::vector<Prim> sorted(prims.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            sorted[i] = prims[order[i]];
+        }
+        prims.swap(sorted);
+    }
+    // recompute node bounds after objects moved; the tree shape stays as built
+    void Refit()
+    {
+        for (int n = (int)nodes.size() - 1; n >= 0; n--)
+        {
+            Node &node = nodes[n];
+            node.bounds = AABB();
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    node.bounds.Grow(PrimitiveBounds(prims[i]));
+                }
+            }
+            else
+            {
+                node.bounds.Grow(nodes[n + 1].bounds);
+                node.bounds.Grow(nodes[node.first].bounds);
+            }
+        }
+    }
+    AABB Bounds() const
+    {
+        return nodes.empty() ? AABB() : nodes[0].bounds;
+    }
+    // calls visit(first, count) for the primitives of every leaf, in storage order
+    template <typename Visit>
+    void ForEachLeaf(Visit &&visit) const
+    {
+        for (const Node &node : nodes)
+        {
+            if (node.count > 0)
+            {
+                visit(prims.data() + node.first, node.count);
+            }
+        }
+    }
+    // Calls visit(object) for every object whose box the ray enters within [t_min, t_max], near
+    // children first. visit returns the new t_max (shrink it for closest-hit queries) or a
+    // negative value to stop the traversal.
+    template <typename Visit>
+    void Traverse(const Point &origin, const Vec3 &direction, Real t_min, Real t_max, Visit &&visit) const
+    {
+        if (nodes.empty())
+        {
+            return;
+        }
+        Vec3 inv_dir(1 / direction.x, 1 / direction.y, 1 / direction.z);
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node &node = nodes[stack[--top]];
+            if (!node.bounds.Hit(origin, inv_dir, t_min, t_max))
+            {
+                continue;
+            }
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    t_max = visit(prims[i]);
+                    if (t_max < 0)
+                    {
+                        return;
+                    }
+                }
+                continue;
+            }
+            int near_child = &node - nodes.data() + 1, far_child = node.first;
+            if ((&direction.x)[node.axis] < 0)
+            {
+                std::swap(near_child, far_child);
+            }
+            stack[top++] = far_child;
+            stack[top++] = near_child;
+        }
+    }
+
+private:
+    struct Node
+    {
+        AABB bounds;
+        // leaf: first primitive and count > 0; interior: right child index and count == 0
+        int first = 0;
+        int count = 0;
+        int axis = 0;
+    };
+    int build(const std::vector<AABB> &bounds, std::vector<int> &order, int begin, int end)
+    {
+        int index = (int)nodes.size();
+        nodes.emplace_back();
+        AABB box, centers;
+        for (int i = begin; i < end; i++)
+        {
+            box.Grow(bounds[order[i]]);
+            centers.Grow(bounds[order[i]].Center());
+        }
+        nodes[index].bounds = box;
+        if (end - begin <= leaf_size)
+        {
+            nodes[index].first = begin;
+            nodes[index].count = end - begin;
+            return index;
+        }
+        // median split along the widest axis of the centroids
+        Vec3 extent = centers.max - centers.min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int mid = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b)
+                         {
+            Point ca = bounds[a].Center(), cb = bounds[b].Center();
+            return (&ca.x)[axis] < (&cb.x)[axis]; });
+        build(bounds, order, begin, mid);
+        int right = build(bounds, order, mid, end);
+        nodes[index].first = right;
+        nodes[index].axis = axis;
+        return index;
+    }
+    std::vector<Node> nodes;
+    std::vector<Prim> prims;
+    int leaf_size = kLeafSize;
+};
+
+typedef BasicBVH<Object *> BVH;
@@ -0,0 +1,277 @@
+#pragma once
+#include "image.h"
+#include "input.h"
+#include "rays.h"
+#include "render.h"
+#include "threadpool.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// First hit of one primary ray, everything ShadeHit needs to shade it again. object is the
+// index into InputFileData::objects, -1 for a miss; face is the triangle of an instance's mesh,
+// -1 for other objects; material is the hit material's id, kept so tools can tell which pixels
+// a material edit touches.
+struct GBufferSample
+{
+    Real t;
+    Real point[3];
+    Real geometric_normal[3];
+    Real interpolated_normal[3];
+    Real uv[2];
+    int32_t object;
+    int32_t face;
+    int32_t material;
+    int32_t inside;
+};
+
+// Per-pixel first hits of a region, saved next to the image for look-dev loops. The key
+// covers the camera, the region and all geometry but not lights or materials, so a file
+// saved by an earlier render stays valid exactly when only lighting or shading changed.
+class GBuffer
+{
+public:
+    static constexpr uint32_t kMagic = 0x32464247; // "GBF2"
+
+    static uint64_t Key(const InputFileData &input, const Camera &camera, const Region &region)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&](const void *data, size_t size)
+        {
+            const unsigned char *p = static_cast<const unsigned char *>(data);
+            for (size_t i = 0; i < size; i++)
+            {
+                hash = (hash ^ p[i]) * 1099511628211ull;
+            }
+        };
+        auto mix_vec = [&](const Vec3 &v)
+        {
+            Real xyz[3] = {v.x, v.y, v.z};
+            mix(xyz, sizeof(xyz));
+        };
+        uint32_t real_size = sizeof(Real);
+        mix(&real_size, sizeof(real_size));
+        mix_vec(camera.eye);
+        mix_vec(camera.v);
+        mix_vec(camera.delta_h);
+        mix_vec(camera.lr);
+        Real camera_size[3] = {camera.width, camera.height, camera.spread};
+        mix(camera_size, sizeof(camera_size));
+        int dims[6] = {camera.image_width, camera.image_height, region.x0, region.y0, region.x1, region.y1};
+        mix(dims, sizeof(dims));
+        auto mix_face = [&](const Face &face)
+        {
+            mix(&face.has_normals, sizeof(face.has_normals));
+            for (const Vertex *v : {&face.v0, &face.v1, &face.v2})
+            {
+                mix_vec(v->pos);
+                mix_vec(v->normal);
+                mix(&v->texture_coord.first, sizeof(v->texture_coord.first));
+                mix(&v->texture_coord.second, sizeof(v->texture_coord.second));
+            }
+        };
+        // each mesh once, then instances by name and transform
+        for (const auto &[name, mesh] : input.meshes)
+        {
+            mix(name.data(), name.size() + 1);
+            if (mesh->file)
+            {
+                // the cluster table stands in for triangles that are not loaded
+                mix(mesh->file->path.data(), mesh->file->path.size() + 1);
+                for (const auto &cluster : mesh->file->clusters)
+                {
+                    mix_vec(cluster.bounds.min);
+                    mix_vec(cluster.bounds.max);
+                    mix(&cluster.count, sizeof(cluster.count));
+                }
+            }
+            for (const auto &face : mesh->faces)
+            {
+                mix_face(*face);
+            }
+        }
+        for (const auto &object : input.objects)
+        {
+            mix(&object->type, sizeof(object->type));
+            if (object->type == ObjectType::SPHERE)
+            {
+                const auto &sphere = static_cast<const Sphere &>(*object);
+                mix_vec(sphere.pos);
+                mix(&sphere.radius, sizeof(sphere.radius));
+                continue;
+            }
+            if (object->type == ObjectType::INSTANCE)
+            {
+                const auto &instance = static_cast<const Instance &>(*object);
+                mix(instance.mesh->name.data(), instance.mesh->name.size() + 1);
+                mix(instance.to_world.m, sizeof(instance.to_world.m));
+                continue;
+            }
+            mix_face(static_cast<const Face &>(*object));
+        }
+        return hash;
+    }
+    // true if `path` holds a buffer for `key`
+    bool Load(const std::string &path, uint64_t key)
+    {
+        std::ifstream file(path, std::ios::binary);
+        Header header;
+        if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != kMagic || header.key != key)
+        {
+            return false;
+        }
+        samples.resize(header.count);
+        return (bool)file.read(reinterpret_cast<char *>(samples.data()), samples.size() * sizeof(GBufferSample));
+    }
+    void Save(const std::string &path, uint64_t key) const
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        Header header = {kMagic, 0, key, samples.size()};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(samples.data()), samples.size() * sizeof(GBufferSample));
+        if (!file)
+        {
+            std::cerr << "Failed to write " << path << std::endl;
+        }
+    }
+    static GBufferSample Record(const RayResult &hit)
+    {
+        GBufferSample s;
+        std::memset(&s, 0, sizeof(s));
+        s.t = hit.t;
+        s.object = -1;
+        s.face = -1;
+        s.material = -1;
+        if (hit.t < 0)
+        {
+            return s;
+        }
+        auto copy = [](Real *out, const Vec3 &v)
+        {
+            out[0] = v.x;
+            out[1] = v.y;
+            out[2] = v.z;
+        };
+        copy(s.point, hit.point);
+        copy(s.geometric_normal, hit.geometric_normal);
+        copy(s.interpolated_normal, hit.interpolated_normal);
+        s.uv[0] = hit.interpolated_uv.x;
+        s.uv[1] = hit.interpolated_uv.y;
+        // the index is what survives a reparse, the pointer does not
+        s.object = hit.object->index;
+        s.face = hit.face ? hit.face->index : -1;
+        s.material = shading_material(*hit.object).id;
+        s.inside = hit.inside;
+        return s;
+    }
+    static RayResult Restore(const GBufferSample &s, const InputFileData &input)
+    {
+        RayResult hit;
+        hit.t = s.object < 0 ? -1 : s.t;
+        if (s.object < 0)
+        {
+            return hit;
+        }
+        hit.point = Point(s.point[0], s.point[1], s.point[2]);
+        hit.geometric_normal = Vec3(s.geometric_normal[0], s.geometric_normal[1], s.geometric_normal[2]);
+        hit.interpolated_normal = Vec3(s.interpolated_normal[0], s.interpolated_normal[1], s.interpolated_normal[2]);
+        hit.interpolated_uv = Vec3(s.uv[0], s.uv[1], 0);
+        hit.object = input.objects[s.object].get();
+        if (s.face >= 0)
+        {
+            const Mesh &mesh = *static_cast<const Instance &>(*hit.object).mesh;
+            if (mesh.file)
+            {
+                const MeshFile::Cluster &cluster = mesh.file->ClusterOf(s.face);
+                hit.cluster = mesh.file->Acquire(cluster);
+                if (hit.cluster->compact.empty())
+                {
+                    hit.face = &hit.cluster->faces[s.face - cluster.first];
+                }
+                else
+                {
+                    hit.decoded = hit.cluster->DecodeFace(s.face - cluster.first);
+                    hit.face = hit.decoded.get();
+                }
+            }
+            else
+            {
+                hit.face = mesh.faces[s.face].get();
+            }
+        }
+        hit.inside = s.inside != 0;
+        return hit;
+    }
+    std::vector<GBufferSample> samples;
+
+private:
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t reserved;
+        uint64_t key;
+        uint64_t count;
+    };
+};
+
+// RenderRegion with the first hits taken from `gbuffer_path` when it matches the view and
+// geometry; otherwise primary rays are traced as usual and the file is (re)written. Secondary
+// rays are always traced, so reflections and refractions pick up material changes too.
+void RenderRegionCached(InputFileData &input, const Camera &camera, const Region &region, Image &image,
+                        ThreadPool &pool, const std::string &gbuffer_path, TileStream *stream = nullptr)
+{
+    uint64_t key = GBuffer::Key(input, camera, region);
+    GBuffer gbuffer;
+    bool reuse = gbuffer.Load(gbuffer_path, key) && gbuffer.samples.size() == (size_t)region.Width() * region.Height();
+    if (!reuse)
+    {
+        gbuffer.samples.assign((size_t)region.Width() * region.Height(), GBufferSample());
+        CullToView(input, camera, region);
+    }
+    int tiles_x = (region.Width() + kTileSize - 1) / kTileSize;
+    int tiles_y = (region.Height() + kTileSize - 1) / kTileSize;
+    pool.ParallelFor(tiles_x * tiles_y, [&](int tile)
+                     {
+        int tx0 = region.x0 + (tile % tiles_x) * kTileSize;
+        int ty0 = region.y0 + (tile / tiles_x) * kTileSize;
+        int tx1 = std::min(tx0 + kTileSize, region.x1);
+        int ty1 = std::min(ty0 + kTileSize, region.y1);
+        for (int j = ty0; j < ty1; j++)
+        {
+            for (int i = tx0; i < tx1; i++)
+            {
+                Ray ray = camera.PrimaryRay(i, j);
+                GBufferSample &sample = gbuffer.samples[(size_t)(j - region.y0) * region.Width() + (i - region.x0)];
+                RayResult hit;
+                if (reuse)
+                {
+                    hit = GBuffer::Restore(sample, input);
+                }
+                else
+                {
+                    hit = IntersectScene(ray, SceneBVH(input, 1));
+                    sample = GBuffer::Record(hit);
+                }
+                active_pixel = PixelKey(i, j);
+                Color color = hit.t < 0 ? input.bkgcolor : ShadeHit(ray, hit, 1, input);
+                image.setPixel(i - region.x0, j - region.y0, color);
+            }
+        }
+        TextureCache::Global().Unpin();
+        if (stream)
+        {
+            stream->Emit(image, tx0, ty0, tx1, ty1);
+        } });
+    if (reuse)
+    {
+        std::cout << "Reused first hits from " << gbuffer_path << std::endl;
+    }
+    else
+    {
+        gbuffer.Save(gbuffer_path, key);
+        std::cout << "Saved first hits to " << gbuffer_path << std::endl;
+    }
+}
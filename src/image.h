@@ -1,10 +1,14 @@
 #pragma once
 #include "color.h"
+#include "png.h"
+#include "threadpool.h"
+#include "tonemap.h"
+#include <cstdint>
+#include <cstring>
 #include <vector>
 #include <fstream>
-
-#include <mutex>
-#include <thread>
+#include <sstream>
+#include <string>
 class Image
 {
 public:
@@ -34,72 +38,205 @@ public:
     {
         pixels.resize(width * height, c);
     }
-    void save(const std::string &name)
-    {
-        // //overwrite the file if it exists
-        // std::ofstream file(name, std::ios::out | std::ios::trunc);
-        // file << "P3"<<std::endl;
-        // file << width << " " << height << std::endl;
-        // file << "255" << std::endl;
-        // for (int i = 0; i < width * height; i++) {
-        //     file << Color::scale_color(pixels[i]) << std::endl;
-        // }
-        // file.close();
-
-        const int num_threads = std::thread::hardware_concurrency();
-        std::vector<std::thread> threads(num_threads);
-
-        auto save_section = [&](int thread_id, int start, int end)
+    const Color *Row(int y) const
+    {
+        return &pixels[(size_t)y * width];
+    }
+    // Write the image in the format its extension names: .pfm and .half keep the unclamped
+    // floats, .png is compressed 8-bit, anything else is an 8-bit P3 file. With a pool, rows are converted and formatted
+    // in parallel; without one (e.g. from a thread that renders alongside the pool) everything
+    // happens on the calling thread.
+    void save(const std::string &name, ThreadPool *pool = nullptr) const
+    {
+        if (EndsWith(name, ".pfm"))
         {
-            std::string section_name = name + "_section_" + std::to_string(thread_id) + ".tmp";
-            std::ofstream file(section_name, std::ios::out | std::ios::trunc);
-
-            for (int i = start; i < end; i++)
+            savePFM(name);
+        }
+        else if (EndsWith(name, ".half"))
+        {
+            saveHalf(name);
+        }
+        else
+        {
+            SaveRGB8(name, width, height, toRGB8(pool), pool);
+        }
+    }
+    static bool IsFloatFormat(const std::string &name)
+    {
+        return EndsWith(name, ".pfm") || EndsWith(name, ".half");
+    }
+    static bool EndsWith(const std::string &name, const std::string &suffix)
+    {
+        return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+    // Portable float map: "PF", size, a negative scale for little-endian data, then float RGB
+    // rows from the bottom of the image up, in one write
+    void savePFM(const std::string &name) const
+    {
+        std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+        std::vector<float> data((size_t)width * height * 3);
+        for (int y = 0; y < height; y++)
+        {
+            const Color *row = &pixels[(size_t)(height - 1 - y) * width];
+            std::copy(&row[0].R, &row[0].R + (size_t)width * 3, &data[(size_t)y * width * 3]);
+        }
+        writeFile(name, header, data.data(), data.size() * sizeof(float));
+    }
+    // Raw IEEE half floats, RGB rows from the top down in native (little-endian) byte order and
+    // no header: width * height * 6 bytes for the render's imsize or region, in one write
+    void saveHalf(const std::string &name) const
+    {
+        std::vector<uint16_t> data((size_t)width * height * 3);
+        const float *in = &pixels[0].R;
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            data[i] = FloatToHalf(in[i]);
+        }
+        writeFile(name, "", data.data(), data.size() * sizeof(uint16_t));
+    }
+    // round to nearest even; too large becomes infinity, too small a subnormal or zero
+    static uint16_t FloatToHalf(float f)
+    {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        uint16_t sign = (x >> 16) & 0x8000;
+        uint32_t magnitude = x & 0x7FFFFFFF;
+        if (magnitude >= 0x7F800000)
+        {
+            // infinity, or a quiet NaN
+            return sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0);
+        }
+        if (magnitude >= 0x477FF000)
+        {
+            // rounds to above 65504
+            return sign | 0x7C00;
+        }
+        if (magnitude < 0x38800000)
+        {
+            // subnormal half: shift the mantissa, with its implicit bit, into place
+            int shift = 126 - (int)(magnitude >> 23);
+            if (shift > 24)
             {
-                for (int j = 0; j < width; j++)
-                {
-                    file << Color::scale_color(pixels[i * width + j]) << std::endl;
-                }
+                return sign;
             }
-            file.close();
+            uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+            uint32_t half = mantissa >> shift;
+            uint32_t rest = mantissa & ((1u << shift) - 1);
+            uint32_t midpoint = 1u << (shift - 1);
+            if (rest > midpoint || (rest == midpoint && (half & 1)))
+            {
+                half++;
+            }
+            return sign | (uint16_t)half;
+        }
+        // rebias the exponent and round the 13 dropped mantissa bits; a carry correctly
+        // moves into the exponent
+        uint32_t half = (magnitude - 0x38000000) >> 13;
+        uint32_t rest = magnitude & 0x1FFF;
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        {
+            half++;
+        }
+        return sign | (uint16_t)half;
+    }
+    // 8-bit RGB, row by row, through ToneMap::Output()
+    std::vector<uint8_t> toRGB8(ThreadPool *pool = nullptr) const
+    {
+        std::vector<uint8_t> bytes((size_t)width * height * 3);
+        const ToneMap &tone = ToneMap::Output();
+        auto convert = [&](int row)
+        {
+            tone.ConvertRow(Row(row), width, origin_x, origin_y + row, &bytes[(size_t)row * width * 3]);
         };
-
-        // Assign work to threads
-        int rows_per_thread = height / num_threads;
-        for (int t = 0; t < num_threads; t++)
+        if (pool)
         {
-            int start = t * rows_per_thread;
-            int end = (t == num_threads - 1) ? height : start + rows_per_thread;
-
-            threads[t] = std::thread(save_section, t, start, end);
+            pool->ParallelFor(height, convert);
         }
-
-        // Wait for all threads to complete their work
-        for (auto &t : threads)
+        else
         {
-            if (t.joinable())
+            for (int row = 0; row < height; row++)
             {
-                t.join();
+                convert(row);
             }
         }
-
-        // Merge temporary files to create the final image file
+        return bytes;
+    }
+    // write 8-bit RGB rows as PNG if the name ends in .png, else as P3, one "R G B " line per
+    // pixel; with a pool, bands of rows are formatted in parallel, one batch of bands at a time
+    // so the text never all sits in memory
+    static void SaveRGB8(const std::string &name, int width, int height, const std::vector<uint8_t> &bytes,
+                         ThreadPool *pool = nullptr)
+    {
+        if (EndsWith(name, ".png"))
+        {
+            Png::Write(name, width, height, bytes, pool);
+            return;
+        }
         std::ofstream file(name, std::ios::out | std::ios::trunc);
         file << "P3" << std::endl;
         file << width << " " << height << std::endl;
         file << "255" << std::endl;
-
-        for (int t = 0; t < num_threads; t++)
+        const int band_rows = 32;
+        const int batch = pool ? pool->Size() : 1;
+        std::vector<std::string> text(batch);
+        for (int first = 0; first < height; first += band_rows * batch)
         {
-            std::string section_name = name + "_section_" + std::to_string(t) + ".tmp";
-            std::ifstream section_file(section_name);
-            file << section_file.rdbuf();
-            section_file.close();
-            std::remove(section_name.c_str());
+            auto format = [&](int band)
+            {
+                int y0 = std::min(first + band * band_rows, height);
+                int y1 = std::min(y0 + band_rows, height);
+                std::string &out = text[band];
+                out.clear();
+                for (size_t i = (size_t)y0 * width * 3; i < (size_t)y1 * width * 3; i += 3)
+                {
+                    for (int k = 0; k < 3; k++)
+                    {
+                        appendDecimal(out, bytes[i + k]);
+                        out += ' ';
+                    }
+                    out += '\n';
+                }
+            };
+            if (pool)
+            {
+                pool->ParallelFor(batch, format);
+            }
+            else
+            {
+                format(0);
+            }
+            for (const std::string &band : text)
+            {
+                file << band;
+            }
         }
-
         file.close();
     }
+    // read a P3 file back as 8-bit RGB rows without going through Color, so copying pixels
+    // between files never requantizes them
+    static std::vector<uint8_t> ReadRGB8(const std::string &name, int &width, int &height)
+    {
+        std::ifstream file(name, std::ios::in);
+        std::string header;
+        int max_color = 0;
+        if (!(file >> header >> width >> height >> max_color) || header != "P3" || max_color != 255)
+        {
+            std::cerr << "Invalid PPM file " << name << std::endl;
+            exit(1);
+        }
+        std::vector<uint8_t> bytes(width * height * 3);
+        for (auto &b : bytes)
+        {
+            int value;
+            if (!(file >> value))
+            {
+                std::cerr << "Truncated PPM file " << name << std::endl;
+                exit(1);
+            }
+            b = (uint8_t)value;
+        }
+        return bytes;
+    }
     static Image ReadPPM(const std::string &name)
     {
         std::ifstream file(name, std::ios::in);
@@ -136,7 +273,31 @@ public:
     }
     int width, height;
     std::string name;
+    // position of pixel (0, 0) in the full image, which the dither pattern is aligned to
+    int origin_x = 0, origin_y = 0;
 
 private:
+    static void writeFile(const std::string &name, const std::string &header, const void *data, size_t bytes)
+    {
+        std::ofstream file(name, std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write(header.data(), header.size());
+        file.write(static_cast<const char *>(data), bytes);
+        if (!file)
+        {
+            std::cerr << "Failed to write " << name << std::endl;
+        }
+    }
+    static void appendDecimal(std::string &out, uint8_t v)
+    {
+        if (v >= 100)
+        {
+            out += (char)('0' + v / 100);
+        }
+        if (v >= 10)
+        {
+            out += (char)('0' + v / 10 % 10);
+        }
+        out += (char)('0' + v % 10);
+    }
     std::vector<Color> pixels;
 };
\ No newline at end of file
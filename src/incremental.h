@@ -0,0 +1,164 @@
+#pragma once
+#include "bvh.h"
+#include "image.h"
+#include "input.h"
+#include "options.h"
+#include "render.h"
+#include "threadpool.h"
+#include <cmath>
+#include <optional>
+#include <vector>
+
+// Apply a client edit to the loaded scene. Returns false for an object index that does not
+// exist. Moves refit the BVH; material changes re-pick the object's shader.
+bool ApplyEdit(InputFileData &input, const SceneEdit &edit)
+{
+    if (edit.kind == EDIT_NONE)
+    {
+        return true;
+    }
+    if (edit.object < 0 || edit.object >= (int)input.objects.size())
+    {
+        return false;
+    }
+    Object &object = *input.objects[edit.object];
+    if (edit.kind == EDIT_MOVE)
+    {
+        Vec3 offset((Real)edit.translate[0], (Real)edit.translate[1], (Real)edit.translate[2]);
+        if (object.type == ObjectType::SPHERE)
+        {
+            static_cast<Sphere &>(object).pos += offset;
+        }
+        else if (object.type == ObjectType::INSTANCE)
+        {
+            static_cast<Instance &>(object).Translate(offset);
+        }
+        else
+        {
+            auto &face = static_cast<Face &>(object);
+            face.v0.pos += offset;
+            face.v1.pos += offset;
+            face.v2.pos += offset;
+        }
+        input.bvh.Refit();
+        return true;
+    }
+    const double *m = edit.material;
+    Material &material = shading_material(object);
+    int id = material.id;
+    material = Material(Color(m[0], m[1], m[2]), Color(m[3], m[4], m[5]), m[6], m[7], m[8], m[9], m[11], m[10]);
+    material.id = id;
+    classify_shaders(input);
+    return true;
+}
+
+static bool SameView(const View &a, const View &b)
+{
+    const Camera &x = a.camera, &y = b.camera;
+    return x.eye == y.eye && x.v == y.v && x.delta_h == y.delta_h && x.lr == y.lr && x.width == y.width &&
+           x.height == y.height && x.image_width == y.image_width && x.image_height == y.image_height &&
+           a.region.x0 == b.region.x0 && a.region.y0 == b.region.y0 && a.region.x1 == b.region.x1 &&
+           a.region.y1 == b.region.y1;
+}
+
+// The last image a render server produced, with a TileTouch per tile. While the view stays
+// the same, an edit only re-renders the tiles whose rays reached the edited object. A moved
+// object can also show up where it never was, so for moves a tile is re-rendered as well when
+// the object's new bounds project onto it or may be crossed by its shadow and secondary rays.
+class RenderSession
+{
+public:
+    // Renders `view` into Frame(), reusing tiles from the previous call when only `edit`
+    // changed the scene since then; `edit` must already be applied. Returns the number of
+    // tiles rendered.
+    int Render(InputFileData &input, const View &view, const SceneEdit &edit, ThreadPool &pool)
+    {
+        int tiles_x = (view.region.Width() + kTileSize - 1) / kTileSize;
+        int tiles_y = (view.region.Height() + kTileSize - 1) / kTileSize;
+        bool incremental = last && SameView(*last, view) && touches.size() == (size_t)tiles_x * tiles_y &&
+                           input.objects.size() == object_count;
+        if (!incremental)
+        {
+            image = Image(view.region.Width(), view.region.Height());
+            image.origin_x = view.region.x0;
+            image.origin_y = view.region.y0;
+            image.fill(input.bkgcolor);
+            touches.assign(tiles_x * tiles_y, TileTouch());
+            object_count = input.objects.size();
+            last = view;
+            RenderRegion(input, view.camera, view.region, image, pool, &touches);
+            return tiles_x * tiles_y;
+        }
+        std::vector<int> tiles = affected(input, view, tiles_x, edit);
+        RenderRegion(input, view.camera, view.region, image, pool, &touches, &tiles);
+        return (int)tiles.size();
+    }
+    const Image &Frame() const
+    {
+        return image;
+    }
+
+private:
+    std::vector<int> affected(const InputFileData &input, const View &view, int tiles_x, const SceneEdit &edit) const
+    {
+        std::vector<int> tiles;
+        if (edit.kind == EDIT_NONE)
+        {
+            return tiles;
+        }
+        const Object &object = *input.objects[edit.object];
+        bool moved = edit.kind == EDIT_MOVE;
+        AABB bounds = ObjectBounds(object);
+        // pixel rectangle the moved object can cover
+        Real x0 = view.region.x0, y0 = view.region.y0, x1 = view.region.x1, y1 = view.region.y1;
+        if (moved)
+        {
+            Real min_i = INFINITY, min_j = INFINITY, max_i = -INFINITY, max_j = -INFINITY;
+            bool visible = true;
+            for (int c = 0; c < 8; c++)
+            {
+                Point corner(c & 1 ? bounds.max.x : bounds.min.x, c & 2 ? bounds.max.y : bounds.min.y,
+                             c & 4 ? bounds.max.z : bounds.min.z);
+                Real i, j;
+                visible = view.camera.Project(corner, i, j);
+                if (!visible)
+                {
+                    break;
+                }
+                min_i = std::min(min_i, i);
+                max_i = std::max(max_i, i);
+                min_j = std::min(min_j, j);
+                max_j = std::max(max_j, j);
+            }
+            // a box reaching behind the eye can cover the whole image
+            if (visible)
+            {
+                x0 = std::floor(min_i) - 1;
+                x1 = std::ceil(max_i) + 1;
+                y0 = std::floor(min_j) - 1;
+                y1 = std::ceil(max_j) + 1;
+            }
+        }
+        for (int tile = 0; tile < (int)touches.size(); tile++)
+        {
+            const TileTouch &touch = touches[tile];
+            bool hit = touch.Touched(edit.object);
+            if (!hit && moved)
+            {
+                int tx0 = view.region.x0 + (tile % tiles_x) * kTileSize;
+                int ty0 = view.region.y0 + (tile / tiles_x) * kTileSize;
+                hit = tx0 < x1 && x0 < tx0 + kTileSize && ty0 < y1 && y0 < ty0 + kTileSize;
+                hit = hit || touch.MayCross(bounds);
+            }
+            if (hit)
+            {
+                tiles.push_back(tile);
+            }
+        }
+        return tiles;
+    }
+    std::optional<View> last;
+    Image image;
+    std::vector<TileTouch> touches;
+    size_t object_count = 0;
+};
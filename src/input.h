@@ -1,6 +1,10 @@
 #pragma once
 #include "mathUtil.h"
 #include "color.h"
+#include "texture.h"
+#include "bvh.h"
+#include "lights.h"
+#include "view.h"
 #include <fstream>
 #include <vector>
 #include <sstream>
@@ -13,6 +17,7 @@
 #include <sstream>
 #include <algorithm>
 #include <memory>
+#include <atomic>
 
 void extract_face_vertices_and_normals(const std::string& face_string,
                                         std::vector<int>& vertex_indices,
@@ -27,11 +32,13 @@ struct Material
     float specular_exponent;
     float eta;
     float alpha;
+    // index of the mtlcolor line that defined it, in file order
+    int id = -1;
     Material(Color diffuse, Color specular, float k_ambient, float k_diffuse, float k_specular, float intensity, float eta, float alpha): 
         diffuse(diffuse), specular(specular), k_ambient(k_ambient), k_diffuse(k_diffuse), k_specular(k_specular), specular_exponent(intensity), eta(eta), alpha(alpha) {}
     Material() : diffuse(0, 0, 0), specular(0, 0, 0), k_ambient(0), k_diffuse(0), k_specular(0), specular_exponent(0), eta(0), alpha(0) {}
 };
-enum LightType {POINT, DIRECTIONAL, SPOTLIGHT};
+enum LightType {POINT, DIRECTIONAL, SPOTLIGHT, AREA_RECT, AREA_SPHERE};
 struct Light
 {
     Point pos;
@@ -39,6 +46,40 @@ struct Light
     Light(Point pos, Color color) : pos(pos), color(color) {}
     Light() : pos(0, 0, 0), color(1, 1, 1) {}
     LightType type = POINT;
+    // point lights only: distance at which the light fades out, 0 for no falloff
+    Real range = 0;
+    // smooth window (1 - (d/range)^2)^2, so a ranged light reaches exactly zero at its range
+    Real Falloff(const Point& target) const {
+        if (range <= 0) {
+            return 1;
+        }
+        Real x = Vec3::Distance(pos, target) / range;
+        if (x >= 1) {
+            return 0;
+        }
+        Real w = 1 - x * x;
+        return w * w;
+    }
+    // area lights only: pos is the center, a rectangle spans pos +- edge_u/2 +- edge_v/2
+    Vec3 edge_u{0, 0, 0}, edge_v{0, 0, 0};
+    Real radius = 0;
+    bool IsArea() const {
+        return type == LightType::AREA_RECT || type == LightType::AREA_SPHERE;
+    }
+    // point on an area light for (u, v) in [0, 1)^2. A sphere is sampled on its disk facing
+    // `from`, which is what the sphere covers as seen from there.
+    Point SamplePoint(Real u, Real v, const Point& from) const {
+        if (type == LightType::AREA_RECT) {
+            return pos + edge_u * (u - Real(0.5)) + edge_v * (v - Real(0.5));
+        }
+        Vec3 w = Vec3::Normalize(from - pos);
+        Vec3 a = std::abs(w.x) > Real(0.9) ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+        Vec3 b1 = Vec3::Normalize(Vec3::Cross(w, a));
+        Vec3 b2 = Vec3::Cross(w, b1);
+        Real r = radius * std::sqrt(u);
+        Real phi = 2 * Real(M_PI) * v;
+        return pos + b1 * (r * std::cos(phi)) + b2 * (r * std::sin(phi));
+    }
     Vec3 GetDirection(const Point& target) {
         if (type == LightType::DIRECTIONAL) {
             return Vec3::Normalize(-pos);
@@ -48,7 +89,16 @@ struct Light
         }
     }
 };
-enum class ObjectType {SPHERE, FACE};
+enum class ObjectType {SPHERE, FACE, INSTANCE};
+// material feature set of an object, used to pick a specialized shader instantiation
+enum ShaderFeature : unsigned
+{
+    SHADE_TEXTURED = 1 << 0,
+    SHADE_REFLECTIVE = 1 << 1,
+    SHADE_REFRACTIVE = 1 << 2,
+    SHADE_SMOOTH_NORMALS = 1 << 3,
+    SHADE_FEATURE_COUNT = 1 << 4
+};
 
 class Object {
 public:
@@ -56,8 +106,12 @@ public:
     int id;
     int texture_index = -1;
     ObjectType type;
+    // set once the scene is parsed, see classify_shaders
+    unsigned shader_features = 0;
+    // position in InputFileData::objects
+    int index = -1;
     Object(const Material& mat) : material(mat) {
-        static int _id = 0;
+        static std::atomic<int> _id{0};
         this->id = _id++;
     }
     virtual Vec3 GetNormal(Point p = Vec3(0, 0, 0)) = 0;
@@ -67,8 +121,8 @@ public:
 class Sphere : public Object {
 public:
     Vec3 pos{0, 0, 0};
-    float radius{0};
-    Sphere(const Vec3& pos, float radius, const Material& mat)
+    Real radius{0};
+    Sphere(const Vec3& pos, Real radius, const Material& mat)
         : Object(mat), pos(pos), radius(radius) {
             this->type = ObjectType::SPHERE;
         }
@@ -93,7 +147,7 @@ struct Vertex
     Material material;
     Vec3 normal;
     std::pair<float, float> texture_coord;
-    Vertex(Point pos, Vec3 _normal) : pos(pos),normal(normal) {}
+    Vertex(Point pos, Vec3 _normal) : pos(pos),normal(_normal) {}
     Vertex(Point pos) : pos(pos), normal(0, 0, 0), texture_coord(-1, -1) {}
     Vertex() : pos(0, 0, 0) {}
 };
@@ -122,26 +176,222 @@ public:
         return Vec3::Normalize(Vec3::Cross(v0v1, v0v2));
     }
 };
+class MeshFile;
+// Triangles defined once between `mesh NAME` and `endmesh`, in their own coordinates and with
+// a BVH of their own. Instances place them in the scene without copying them. A mesh loaded
+// with `meshfile` keeps its triangles on disk instead, see meshfile.h.
+struct Mesh
+{
+    std::string name;
+    // Object::index of each face is its position here
+    std::vector<std::shared_ptr<Face>> faces;
+    BVH bvh;
+    // set instead of faces and bvh for a mesh streamed from a packed file
+    std::shared_ptr<const MeshFile> file;
+    AABB bounds;
+    // what instances default to: the first face's
+    Material material;
+    int texture_index = -1;
+};
+// defined in meshfile.h: opens a packed mesh file into `mesh`, returning the texture path it
+// was packed with ("" for none)
+std::string OpenMeshFile(const std::string& path, Mesh& mesh);
+// A mesh under an affine transform, with one material for all of its triangles. Rays are
+// carried into the mesh's coordinates to intersect it, so any number of instances share the
+// mesh's faces and BVH.
+class Instance : public Object {
+public:
+    std::shared_ptr<const Mesh> mesh;
+    Affine to_world;
+    Affine to_object;
+    Instance(std::shared_ptr<const Mesh> mesh, const Affine& transform, const Material& mat)
+        : Object(mat), mesh(std::move(mesh)) {
+            this->type = ObjectType::INSTANCE;
+            SetTransform(transform);
+        }
+    // the transform must be invertible
+    void SetTransform(const Affine& transform) {
+        to_world = transform;
+        to_world.Inverse(to_object);
+    }
+    void Translate(const Vec3& offset) {
+        Affine moved = to_world;
+        moved.SetTranslation(to_world.Translation() + offset);
+        SetTransform(moved);
+    }
+    // unit world normal for a normal in mesh coordinates
+    Vec3 NormalToWorld(const Vec3& n) const {
+        return Vec3::Normalize(to_object.ApplyTransposed(n));
+    }
+    // normals depend on the triangle hit, see Ray::Intersect
+    Vec3 GetNormal(Point = Vec3(0, 0, 0)) override {
+        return Vec3(0, 0, 0);
+    }
+};
+AABB ObjectBounds(const Object& object)
+{
+    AABB box;
+    if(object.type == ObjectType::SPHERE)
+    {
+        const auto& sphere = static_cast<const Sphere&>(object);
+        Vec3 r(std::abs(sphere.radius), std::abs(sphere.radius), std::abs(sphere.radius));
+        box.Grow(sphere.pos - r);
+        box.Grow(sphere.pos + r);
+    }
+    else if(object.type == ObjectType::INSTANCE)
+    {
+        // the transformed corners of the mesh's box
+        const auto& instance = static_cast<const Instance&>(object);
+        const AABB& local = instance.mesh->bounds;
+        for(int c = 0; c < 8; c++)
+        {
+            box.Grow(instance.to_world.Apply(Point(c & 1 ? local.max.x : local.min.x, c & 2 ? local.max.y : local.min.y,
+                                                   c & 4 ? local.max.z : local.min.z)));
+        }
+    }
+    else
+    {
+        const auto& face = static_cast<const Face&>(object);
+        box.Grow(face.v0.pos);
+        box.Grow(face.v1.pos);
+        box.Grow(face.v2.pos);
+    }
+    return box;
+}
+// viewpoint from a camera or stereo line, rendered in the same run as the others
+struct SceneCamera
+{
+    std::string name;
+    // the fields the line sets; the rest follow the scene's own eye, viewdir, updir, hfov, imsize
+    ViewOverride view;
+    // sideways eye offset, positive to the right of the image
+    Real shift = 0;
+};
+
 struct InputFileData
 { 
     std::pair<int, int> imsize;
     Point eye;
     Vec3 viewdir;
     Vec3 updir;
-    float hfov;
+    Real hfov;
     Color bkgcolor;
-    float index_of_refraction;
+    Real index_of_refraction;
     std::vector<Sphere> spheres;
     std::vector<Light> lights;
     std::vector<Vertex> vertex_arrays;
     std::vector<Face> faces;
    Material triangle_material;
    std::vector<Vec3> vertex_normals;
-   std::vector<Image> texture;
+   // handles into TextureCache::Global(), indexed by Object::texture_index
+   std::vector<int> texture;
    std::vector<std::pair<int, int>> texture_coords;
    std::vector<std::shared_ptr<Object>> objects;
+   // meshes by name; their faces are only reachable through Instance objects
+   std::map<std::string, std::shared_ptr<Mesh>> meshes;
+   // over objects; call bvh.Refit() after moving them
+   BVH bvh;
+   // over the objects primary rays of the current render can reach, used for them instead of
+   // bvh while primary_culled is set; CullToView rebuilds it at the start of a render when
+   // primary_visible changes and only refits it otherwise
+   BVH primary_bvh;
+   std::vector<Object *> primary_visible;
+   bool primary_culled = false;
+   size_t primary_objects = 0;
+   size_t primary_builds = 0;
+   size_t primary_refits = 0;
+   // over lights; call build_light_grid after changing them
+   LightGrid light_grid;
+   // extra viewpoints in file order; empty renders just the eye/viewdir camera
+   std::vector<SceneCamera> cameras;
 };
 
+void build_light_grid(InputFileData& data)
+{
+    std::vector<Point> centers;
+    std::vector<Real> ranges;
+    for(const auto& light : data.lights)
+    {
+        centers.push_back(light.pos);
+        ranges.push_back(light.type == LightType::POINT ? light.range : 0);
+    }
+    data.light_grid.Build(centers, ranges);
+}
+
+void build_bvh(InputFileData& data)
+{
+    std::vector<Object*> objects;
+    for(auto& object : data.objects)
+    {
+        objects.push_back(object.get());
+    }
+    data.bvh.Build(objects);
+}
+
+
+// material used for shading; faces keep theirs on the first vertex
+const Material& shading_material(const Object& object)
+{
+    if(object.type == ObjectType::FACE)
+    {
+        return static_cast<const Face&>(object).v0.material;
+    }
+    return object.material;
+}
+Material& shading_material(Object& object)
+{
+    return const_cast<Material&>(shading_material(static_cast<const Object&>(object)));
+}
+
+// decide up front which shading code paths each object can reach
+void classify_shaders(InputFileData& data)
+{
+    for(auto& object : data.objects)
+    {
+        const Material& material = shading_material(*object);
+        unsigned features = 0;
+        if(object->texture_index != -1)
+        {
+            features |= SHADE_TEXTURED;
+        }
+        if(material.k_specular > 0)
+        {
+            features |= SHADE_REFLECTIVE;
+        }
+        if(material.alpha < 1.f)
+        {
+            features |= SHADE_REFRACTIVE;
+        }
+        if(object->type == ObjectType::FACE && static_cast<const Face&>(*object).has_normals)
+        {
+            features |= SHADE_SMOOTH_NORMALS;
+        }
+        // Ray::Intersect leaves the world normal of an instance hit in interpolated_normal
+        if(object->type == ObjectType::INSTANCE)
+        {
+            features |= SHADE_SMOOTH_NORMALS;
+        }
+        object->shader_features = features;
+    }
+}
+
+// per-vertex normals of a face from 1-based vn indices; a face naming a normal the file
+// never declared stays flat instead of reading past the list
+bool set_face_normals(Face& f, const std::vector<Vec3>& normals, int vn1, int vn2, int vn3)
+{
+    for(int vn : {vn1, vn2, vn3})
+    {
+        if(vn < 1 || vn > (int)normals.size())
+        {
+            return false;
+        }
+    }
+    f.v0.normal = normals[vn1 - 1];
+    f.v1.normal = normals[vn2 - 1];
+    f.v2.normal = normals[vn3 - 1];
+    f.has_normals = true;
+    return true;
+}
 
 InputFileData get_input(std::string inputfile) {
       
@@ -153,6 +403,11 @@ InputFileData get_input(std::string inputfile) {
     }
     InputFileData res;
     std::string line;
+    int material_count = 0;
+    // set between `mesh NAME` and `endmesh`
+    bool in_mesh = false;
+    std::string mesh_name;
+    size_t mesh_first_object = 0, mesh_first_face = 0;
 
     while (file.good())
     {
@@ -209,6 +464,67 @@ InputFileData get_input(std::string inputfile) {
                 exit(1);
             }
         }
+        //another viewpoint rendered in the same run; shift moves the eye sideways, positive to
+        //the right of the image:
+        //  camera NAME [eye X Y Z] [viewdir X Y Z] [updir X Y Z] [hfov DEG] [imsize W H] [shift D]
+        //or a parallel stereo pair of cameras "left" and "right", SEPARATION apart:
+        //  stereo SEPARATION
+        else if(key == "camera" || key == "stereo")
+        {
+            std::vector<SceneCamera> added(key == "camera" ? 1 : 2);
+            bool valid = true;
+            if(key == "stereo")
+            {
+                Real separation;
+                valid = iss >> separation && separation > 0;
+                added[0].name = "left";
+                added[1].name = "right";
+                added[0].shift = valid ? -separation / 2 : 0;
+                added[1].shift = valid ? separation / 2 : 0;
+            }
+            else
+            {
+                SceneCamera& camera = added[0];
+                ViewOverride& view = camera.view;
+                valid = (bool)(iss >> camera.name);
+                std::string op;
+                while(valid && iss >> op)
+                {
+                    if(op == "eye" && iss >> view.eye[0] >> view.eye[1] >> view.eye[2]) {
+                        view.fields |= VIEW_EYE;
+                    }
+                    else if(op == "viewdir" && iss >> view.viewdir[0] >> view.viewdir[1] >> view.viewdir[2]) {
+                        view.fields |= VIEW_VIEWDIR;
+                    }
+                    else if(op == "updir" && iss >> view.updir[0] >> view.updir[1] >> view.updir[2]) {
+                        view.fields |= VIEW_UPDIR;
+                    }
+                    else if(op == "hfov" && iss >> view.hfov) {
+                        view.fields |= VIEW_HFOV;
+                    }
+                    else if(op == "imsize" && iss >> view.imsize[0] >> view.imsize[1]) {
+                        view.fields |= VIEW_IMSIZE;
+                    }
+                    else if(op == "shift" && iss >> camera.shift) {
+                    }
+                    else {
+                        valid = false;
+                    }
+                }
+            }
+            for(const SceneCamera& camera : added)
+            {
+                for(const SceneCamera& other : res.cameras)
+                {
+                    valid = valid && other.name != camera.name;
+                }
+            }
+            if(!valid) {
+                std::cerr << "Invalid " << key << " in input file: " << line << std::endl;
+                exit(1);
+            }
+            res.cameras.insert(res.cameras.end(), added.begin(), added.end());
+        }
         else if(key == "bkgcolor")
         {
             //check if the input is valid
@@ -233,6 +549,10 @@ InputFileData get_input(std::string inputfile) {
             if(pointLight == 1)
             {
                 light.type = LightType::POINT;
+                // optional range after the color
+                if(!(iss >> light.range)) {
+                    light.range = 0;
+                }
             }
             else
             {
@@ -240,6 +560,145 @@ InputFileData get_input(std::string inputfile) {
             }
             res.lights.push_back(light);
         }
+        //area light, sampled for soft shadows:
+        //  arealight rect CX CY CZ UX UY UZ VX VY VZ R G B    center and the two edge vectors
+        //  arealight sphere CX CY CZ RADIUS R G B
+        else if(key == "arealight")
+        {
+            Light light;
+            std::string shape;
+            bool valid = false;
+            if(iss >> shape >> light.pos.x >> light.pos.y >> light.pos.z)
+            {
+                if(shape == "rect")
+                {
+                    light.type = LightType::AREA_RECT;
+                    valid = (bool)(iss >> light.edge_u.x >> light.edge_u.y >> light.edge_u.z
+                                       >> light.edge_v.x >> light.edge_v.y >> light.edge_v.z);
+                }
+                else if(shape == "sphere")
+                {
+                    light.type = LightType::AREA_SPHERE;
+                    valid = iss >> light.radius && light.radius > 0;
+                }
+            }
+            if(!valid || !(iss >> light.color.R >> light.color.G >> light.color.B)) {
+                std::cerr << "Invalid arealight in input file" << std::endl;
+                exit(1);
+            }
+            res.lights.push_back(light);
+        }
+        //the faces between these two lines form a mesh that is only drawn through instances
+        //  mesh NAME
+        //  endmesh
+        else if(key == "mesh")
+        {
+            if(in_mesh || !(iss >> mesh_name) || res.meshes.count(mesh_name)) {
+                std::cerr << "Invalid mesh in input file" << std::endl;
+                exit(1);
+            }
+            in_mesh = true;
+            mesh_first_object = res.objects.size();
+            mesh_first_face = res.faces.size();
+        }
+        else if(key == "endmesh")
+        {
+            if(!in_mesh) {
+                std::cerr << "endmesh without mesh in input file" << std::endl;
+                exit(1);
+            }
+            auto mesh = std::make_shared<Mesh>();
+            mesh->name = mesh_name;
+            std::vector<Object*> faces;
+            for(size_t i = mesh_first_object; i < res.objects.size(); i++)
+            {
+                if(res.objects[i]->type != ObjectType::FACE) {
+                    std::cerr << "Only faces can be part of mesh " << mesh_name << std::endl;
+                    exit(1);
+                }
+                auto face = std::static_pointer_cast<Face>(res.objects[i]);
+                face->index = (int)mesh->faces.size();
+                mesh->faces.push_back(face);
+                faces.push_back(face.get());
+            }
+            if(faces.empty()) {
+                std::cerr << "Empty mesh " << mesh_name << " in input file" << std::endl;
+                exit(1);
+            }
+            mesh->bvh.Build(faces);
+            mesh->bounds = mesh->bvh.Bounds();
+            mesh->material = mesh->faces[0]->v0.material;
+            mesh->texture_index = mesh->faces[0]->texture_index;
+            res.objects.resize(mesh_first_object);
+            res.faces.resize(mesh_first_face);
+            res.meshes[mesh_name] = mesh;
+            in_mesh = false;
+        }
+        //a mesh packed with --pack-mesh, paged in from disk as rays reach its parts
+        //  meshfile NAME PATH
+        else if(key == "meshfile")
+        {
+            std::string name, path;
+            if(in_mesh || !(iss >> name >> path) || res.meshes.count(name)) {
+                std::cerr << "Invalid meshfile in input file" << std::endl;
+                exit(1);
+            }
+            auto mesh = std::make_shared<Mesh>();
+            mesh->name = name;
+            std::string texture_path = OpenMeshFile(path, *mesh);
+            if(!texture_path.empty())
+            {
+                res.texture.push_back(TextureCache::Global().Register(texture_path));
+                mesh->texture_index = res.texture.size() - 1;
+            }
+            res.meshes[name] = mesh;
+        }
+        //a mesh placed in the scene, transformed in the order given, optionally with its own
+        //material instead of the one of its first face:
+        //  instance NAME [translate X Y Z] [rotate AX AY AZ DEGREES] [scale SX SY SZ] [mtlcolor ...]
+        else if(key == "instance")
+        {
+            std::string name;
+            iss >> name;
+            auto mesh = res.meshes.find(name);
+            if(mesh == res.meshes.end()) {
+                std::cerr << "Unknown mesh " << name << " in input file" << std::endl;
+                exit(1);
+            }
+            Material material = mesh->second->material;
+            Affine transform;
+            std::string op;
+            bool valid = true;
+            while(valid && iss >> op)
+            {
+                Vec3 v;
+                Real degrees;
+                if(op == "translate" && iss >> v.x >> v.y >> v.z) {
+                    transform = Affine::Translate(v) * transform;
+                }
+                else if(op == "rotate" && iss >> v.x >> v.y >> v.z >> degrees && v.LenSq() > 0) {
+                    transform = Affine::Rotate(v, degrees) * transform;
+                }
+                else if(op == "scale" && iss >> v.x >> v.y >> v.z) {
+                    transform = Affine::Scale(v) * transform;
+                }
+                else if(op == "mtlcolor" && iss >> material.diffuse.R >> material.diffuse.G >> material.diffuse.B >> material.specular.R >> material.specular.G >>
+                        material.specular.B >> material.k_ambient >> material.k_diffuse >> material.k_specular >> material.specular_exponent >> material.alpha >> material.eta) {
+                    material.id = material_count++;
+                }
+                else {
+                    valid = false;
+                }
+            }
+            Affine inverse;
+            if(!valid || !transform.Inverse(inverse)) {
+                std::cerr << "Invalid instance of " << name << " in input file" << std::endl;
+                exit(1);
+            }
+            auto instance = std::make_shared<Instance>(mesh->second, transform, material);
+            instance->texture_index = mesh->second->texture_index;
+            res.objects.push_back(instance);
+        }
         else if( key == "v")
         {
             Point p;
@@ -271,6 +730,7 @@ InputFileData get_input(std::string inputfile) {
         else if(key == "mtlcolor")
         {
             Material material;
+            material.id = material_count++;
             if(!(iss >> material.diffuse.R>> material.diffuse.G>> material.diffuse.B>> material.specular.R>> material.specular.G>> 
                     material.specular.B>> material.k_ambient>> material.k_diffuse>> material.k_specular>> material.specular_exponent >>material.alpha>>material.eta))
             {
@@ -293,7 +753,7 @@ InputFileData get_input(std::string inputfile) {
                 if (key == "sphere")
                 {
                     Vec3 pos;
-                    float radius;
+                    Real radius;
                     //check if the input is valid
                     if(!(iss >> pos.x >> pos.y >> pos.z >> radius)) {
                         std::cerr << "Invalid sphere(x, y, z, r) in input file" << std::endl;
@@ -355,11 +815,8 @@ InputFileData get_input(std::string inputfile) {
                         f.v0 = res.vertex_arrays[v1 - 1];
                         f.v1 = res.vertex_arrays[v2 - 1];
                         f.v2 = res.vertex_arrays[v3 - 1];
-                        f.v0.normal = res.vertex_normals[vn1 - 1];
-                        f.v1.normal= res.vertex_normals[vn2 - 1];
-                        f.v2.normal = res.vertex_normals[vn3 - 1];
+                        set_face_normals(f, res.vertex_normals, vn1, vn2, vn3);
                         f.v0.material = material;
-                        f.has_normals = true;
                         res.faces.push_back(f);
                     }
                     else if (face_string.find("/") != std::string::npos)
@@ -437,11 +894,8 @@ InputFileData get_input(std::string inputfile) {
                                 std::cerr << "Vertex normals found but no normals specified" << std::endl;
                                 exit(1);
                             }
-                            f.v0.normal = res.vertex_normals[vn1 - 1];
-                            f.v1.normal = res.vertex_normals[vn2 - 1];
-                            f.v2.normal = res.vertex_normals[vn3 - 1];
+                            set_face_normals(f, res.vertex_normals, vn1, vn2, vn3);
                             f.v0.material = material;
-                            f.has_normals = true;
                             res.faces.push_back(f);
                         }
                         else
@@ -470,15 +924,11 @@ InputFileData get_input(std::string inputfile) {
                 else if(key == "texture")
                 {
                     //if res.texture is not initialized, initialize it
-                    if(res.texture.empty())
-                    {
-                        res.texture = std::vector<Image>();
-                    }
                     // extract the filename
                     std::string filename;
                     iss >> filename;
-                    auto texture = Image::ReadPPM(filename);
-                    res.texture.push_back(texture);
+                    // decoded lazily by the cache on first use, shared if already referenced
+                    res.texture.push_back(TextureCache::Global().Register(filename));
                     //get the index of the texture in the vector
                     int index = res.texture.size() - 1;
                     //every sphere/triangle after this line will have this texture until another line that is not sphere/triangle is read
@@ -496,7 +946,7 @@ InputFileData get_input(std::string inputfile) {
                         if (key == "sphere")
                         {
                             Vec3 pos;
-                            float radius;
+                            Real radius;
                             //check if the input is valid
                             if(!(iss >> pos.x >> pos.y >> pos.z >> radius)) {
                                 std::cerr << "Invalid sphere(x, y, z, r) in input file" << std::endl;
@@ -568,10 +1018,7 @@ InputFileData get_input(std::string inputfile) {
                                     exit(1);
                                 }
                                 else{
-                                    f.v0.normal = res.vertex_normals[vn1 - 1];
-                                    f.v1.normal= res.vertex_normals[vn2 - 1];
-                                    f.v2.normal = res.vertex_normals[vn3 - 1];
-                                    f.has_normals = true;
+                                    set_face_normals(f, res.vertex_normals, vn1, vn2, vn3);
                                 }
                                 f.v0.material = material;
                                 res.faces.push_back(f);
@@ -625,12 +1072,9 @@ InputFileData get_input(std::string inputfile) {
                                     f.v0.texture_coord = res.texture_coords[vt1 - 1];
                                     f.v1.texture_coord = res.texture_coords[vt2 - 1];
                                     f.v2.texture_coord = res.texture_coords[vt3 - 1];
-                                    f.v0.normal = res.vertex_normals[vn1 - 1];
-                                    f.v1.normal = res.vertex_normals[vn2 - 1];
-                                    f.v2.normal = res.vertex_normals[vn3 - 1];
+                                    set_face_normals(f, res.vertex_normals, vn1, vn2, vn3);
                                     f.v0.material = material;
                                     f.texture_index = index;
-                                    f.has_normals = true;
                                     res.faces.push_back(f);
                                 }
                                 else
@@ -676,6 +1120,18 @@ InputFileData get_input(std::string inputfile) {
         std::cerr << "Invalid imsize(w, h) in input file" << std::endl;
         exit(1);
     }
+    if(in_mesh)
+    {
+        std::cerr << "mesh " << mesh_name << " has no endmesh in input file" << std::endl;
+        exit(1);
+    }
+    for(size_t i = 0; i < res.objects.size(); i++)
+    {
+        res.objects[i]->index = (int)i;
+    }
+    classify_shaders(res);
+    build_bvh(res);
+    build_light_grid(res);
     return res;
 }
 
@@ -737,7 +1193,7 @@ static void input_print_helper(InputFileData input)
             std::cout << "sphere: " << sphere->pos << " " << sphere->radius;
             if(sphere->texture_index != -1)
             {
-                std::cout << " " << input.texture[sphere->texture_index].name;
+                std::cout << " " << TextureCache::Global().Path(input.texture[sphere->texture_index]);
             }
             std::cout << std::endl;
         }
@@ -782,7 +1238,7 @@ static void input_print_helper(InputFileData input)
             std::cout << face->v2.pos;
             if(face->texture_index != -1)
             {
-                std::cout << " " << input.texture[face->texture_index].name;
+                std::cout << " " << TextureCache::Global().Path(input.texture[face->texture_index]);
             }
             std::cout << std::endl;
         }
@@ -790,7 +1246,7 @@ static void input_print_helper(InputFileData input)
     //print textures
     for(size_t i = 0; i < input.texture.size(); i++)
     {
-        std::cout<<"texture: "<<input.texture[i].name<<std::endl;
+        std::cout<<"texture: "<<TextureCache::Global().Path(input.texture[i])<<std::endl;
     }
 }
 #endif
\ No newline at end of file
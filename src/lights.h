@@ -0,0 +1,135 @@
+#pragma once
+#include "bvh.h"
+#include "mathUtil.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Uniform grid over the spheres of influence of lights with a finite range, with a list of
+// lights per cell. A lookup touches one cell, so shading cost follows the number of lights
+// near a point rather than the number in the scene. Lights without a range reach everything
+// and are always returned.
+class LightGrid
+{
+public:
+    static constexpr int kMaxCellsPerAxis = 64;
+
+    // ranges[i] <= 0 means light i has no range
+    void Build(const std::vector<Point> &centers, const std::vector<Real> &ranges)
+    {
+        unbounded.clear();
+        cell_start.clear();
+        cell_lights.clear();
+        bounds = AABB();
+        Real range_sum = 0;
+        int ranged = 0;
+        for (size_t i = 0; i < centers.size(); i++)
+        {
+            if (ranges[i] <= 0)
+            {
+                unbounded.push_back((int)i);
+                continue;
+            }
+            Vec3 r(ranges[i], ranges[i], ranges[i]);
+            bounds.Grow(centers[i] - r);
+            bounds.Grow(centers[i] + r);
+            range_sum += ranges[i];
+            ranged++;
+        }
+        if (ranged == 0)
+        {
+            return;
+        }
+        // cells about one range across, so a light overlaps a few cells per axis
+        Real cell = range_sum / ranged;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            Real extent = (&bounds.max.x)[axis] - (&bounds.min.x)[axis];
+            res[axis] = std::clamp((int)std::ceil(extent / cell), 1, kMaxCellsPerAxis);
+            (&inv_cell.x)[axis] = extent > 0 ? res[axis] / extent : 0;
+        }
+        // two passes: count lights per cell, then fill the flattened lists
+        cell_start.assign((size_t)res[0] * res[1] * res[2] + 1, 0);
+        for (int pass = 0; pass < 2; pass++)
+        {
+            std::vector<int> fill;
+            if (pass == 1)
+            {
+                for (size_t c = 1; c < cell_start.size(); c++)
+                {
+                    cell_start[c] += cell_start[c - 1];
+                }
+                cell_lights.resize(cell_start.back());
+                fill.assign(cell_start.begin(), cell_start.end() - 1);
+            }
+            for (size_t i = 0; i < centers.size(); i++)
+            {
+                if (ranges[i] <= 0)
+                {
+                    continue;
+                }
+                Vec3 r(ranges[i], ranges[i], ranges[i]);
+                int lo[3], hi[3];
+                cellCoords(centers[i] - r, lo);
+                cellCoords(centers[i] + r, hi);
+                for (int z = lo[2]; z <= hi[2]; z++)
+                {
+                    for (int y = lo[1]; y <= hi[1]; y++)
+                    {
+                        for (int x = lo[0]; x <= hi[0]; x++)
+                        {
+                            int c = (z * res[1] + y) * res[0] + x;
+                            if (pass == 0)
+                            {
+                                cell_start[c + 1]++;
+                            }
+                            else
+                            {
+                                cell_lights[fill[c]++] = (int)i;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    // calls visit(index) for every light that may reach p; ranged lights still need their
+    // distance checked by the caller
+    template <typename Visit>
+    void ForEachCandidate(const Point &p, Visit &&visit) const
+    {
+        for (int i : unbounded)
+        {
+            visit(i);
+        }
+        if (cell_start.empty() || p.x < bounds.min.x || p.y < bounds.min.y || p.z < bounds.min.z ||
+            p.x > bounds.max.x || p.y > bounds.max.y || p.z > bounds.max.z)
+        {
+            return;
+        }
+        int c[3];
+        cellCoords(p, c);
+        int cell = (c[2] * res[1] + c[1]) * res[0] + c[0];
+        for (int k = cell_start[cell]; k < cell_start[cell + 1]; k++)
+        {
+            visit(cell_lights[k]);
+        }
+    }
+
+private:
+    void cellCoords(const Point &p, int *out) const
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int c = (int)(((&p.x)[axis] - (&bounds.min.x)[axis]) * (&inv_cell.x)[axis]);
+            out[axis] = std::clamp(c, 0, res[axis] - 1);
+        }
+    }
+    std::vector<int> unbounded;
+    AABB bounds;
+    int res[3] = {0, 0, 0};
+    Vec3 inv_cell{0, 0, 0};
+    // lights of cell c are cell_lights[cell_start[c] .. cell_start[c + 1])
+    std::vector<int> cell_start;
+    std::vector<int> cell_lights;
+};
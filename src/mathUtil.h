@@ -1,7 +1,16 @@
 #pragma once
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
+// Precision policy for geometry and shading. Colors stay float either way; build with
+// -DRAYTRACER_DOUBLE (make double) for scenes with large coordinates.
+#ifdef RAYTRACER_DOUBLE
+typedef double Real;
+#else
+typedef float Real;
+#endif
+
 template <typename T>
 class _Vec3
 {
@@ -29,7 +38,7 @@ public:
     }
     T       Len() const
     {
-        return sqrt(LenSq());
+        return std::sqrt(LenSq());
     }
     _Vec3&  Normalize()
     {
@@ -100,7 +109,7 @@ public:
         z /= rhs;
         return *this;
     }
-    friend _Vec3 operator*(const float& lhs, const _Vec3& rhs)
+    friend _Vec3 operator*(const T& lhs, const _Vec3& rhs)
     {
         return _Vec3(rhs) *= lhs;
     }
@@ -155,26 +164,26 @@ public:
     //abs
     static _Vec3 Abs(const _Vec3& v)
     {
-        return _Vec3(abs(v.x), abs(v.y), abs(v.z));
+        return _Vec3(std::abs(v.x), std::abs(v.y), std::abs(v.z));
     }
-    static bool Refract(const _Vec3& incident, const _Vec3& normal, float refractive_ratio, _Vec3& refracted) {
+    static bool Refract(const _Vec3& incident, const _Vec3& normal, T refractive_ratio, _Vec3& refracted) {
         auto incident_normalized = Normalize(incident);
-        float cos_theta_i = Dot(-incident_normalized, normal);
-        float sin2_theta_t = refractive_ratio * refractive_ratio * (1.0f - cos_theta_i * cos_theta_i);
+        T cos_theta_i = Dot(-incident_normalized, normal);
+        T sin2_theta_t = refractive_ratio * refractive_ratio * (1 - cos_theta_i * cos_theta_i);
 
-        if (sin2_theta_t > 1.0f) {
+        if (sin2_theta_t > 1) {
             return false; // Total internal reflection occurs
         }
 
-        float cos_theta_t = std::sqrt(1.0f - sin2_theta_t);
+        T cos_theta_t = std::sqrt(1 - sin2_theta_t);
         refracted = (incident_normalized*refractive_ratio) + normal*(refractive_ratio * cos_theta_i - cos_theta_t) ;
         return true;
     }
-    static _Vec3 Refract(const _Vec3 &I, const _Vec3 &N, float eta)
+    static _Vec3 Refract(const _Vec3 &I, const _Vec3 &N, T eta)
 {
-    float cos_theta_i = -std::max(0.0f, Dot(I, N));
-    float eta_i = 1.0f;
-    float eta_t = eta;
+    T cos_theta_i = -std::max(T(0), Dot(I, N));
+    T eta_i = 1;
+    T eta_t = eta;
     _Vec3 N_t = N;
     if (cos_theta_i < 0)
     {
@@ -183,9 +192,9 @@ public:
         N_t = -N;
         cos_theta_i = -cos_theta_i;
     }
-    float eta_ratio = eta_i / eta_t;
-    float k = 1.0f - eta_ratio * eta_ratio * (1.0f - cos_theta_i * cos_theta_i);
-    if (k < 0.0f)
+    T eta_ratio = eta_i / eta_t;
+    T k = 1 - eta_ratio * eta_ratio * (1 - cos_theta_i * cos_theta_i);
+    if (k < 0)
     {
         // Total internal reflection
         return Reflect(I, N);
@@ -193,7 +202,7 @@ public:
     else
     {
         // Refraction
-        return eta_ratio * I + (eta_ratio * cos_theta_i - sqrtf(k)) * N_t;
+        return eta_ratio * I + (eta_ratio * cos_theta_i - std::sqrt(k)) * N_t;
     }
 }
 
@@ -203,7 +212,119 @@ public:
     T z;
 };
 
-typedef _Vec3<float> Vec3;
-typedef _Vec3<float> Point;
+typedef _Vec3<Real> Vec3;
+typedef _Vec3<Real> Point;
 typedef _Vec3<double> Ved3;
-typedef _Vec3<int> Vei3;
\ No newline at end of file
+typedef _Vec3<int> Vei3;
+// Affine map p -> A p + t, stored as the three rows of [A | t].
+struct Affine
+{
+    Real m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+
+    Point Apply(const Point& p) const
+    {
+        return Point(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                     m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                     m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+    // A v, for directions and edges
+    Vec3 ApplyVector(const Vec3& v) const
+    {
+        return Vec3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                    m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                    m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+    // A^T v; on the inverse map this carries normals forward
+    Vec3 ApplyTransposed(const Vec3& v) const
+    {
+        return Vec3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                    m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                    m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+    Point Translation() const
+    {
+        return Point(m[0][3], m[1][3], m[2][3]);
+    }
+    void SetTranslation(const Point& t)
+    {
+        m[0][3] = t.x;
+        m[1][3] = t.y;
+        m[2][3] = t.z;
+    }
+    // this map applied after `rhs`
+    Affine operator*(const Affine& rhs) const
+    {
+        Affine r;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                r.m[i][j] = m[i][0] * rhs.m[0][j] + m[i][1] * rhs.m[1][j] + m[i][2] * rhs.m[2][j] + (j == 3 ? m[i][3] : 0);
+            }
+        }
+        return r;
+    }
+    // false for a singular A, leaving `out` untouched
+    bool Inverse(Affine& out) const
+    {
+        // adjugate over the determinant
+        Real c[3][3];
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                int i1 = (i + 1) % 3, i2 = (i + 2) % 3, j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+                c[j][i] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+            }
+        }
+        Real det = m[0][0] * c[0][0] + m[0][1] * c[1][0] + m[0][2] * c[2][0];
+        if (det == 0)
+        {
+            return false;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                out.m[i][j] = c[i][j] / det;
+            }
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            out.m[i][3] = -(out.m[i][0] * m[0][3] + out.m[i][1] * m[1][3] + out.m[i][2] * m[2][3]);
+        }
+        return true;
+    }
+    static Affine Translate(const Vec3& t)
+    {
+        Affine r;
+        r.SetTranslation(t);
+        return r;
+    }
+    static Affine Scale(const Vec3& s)
+    {
+        Affine r;
+        r.m[0][0] = s.x;
+        r.m[1][1] = s.y;
+        r.m[2][2] = s.z;
+        return r;
+    }
+    // right-handed rotation by `degrees` about `axis`
+    static Affine Rotate(const Vec3& axis, Real degrees)
+    {
+        Vec3 a = Vec3::Normalize(axis);
+        Real rad = degrees * Real(M_PI) / 180;
+        Real c = std::cos(rad), s = std::sin(rad), k = 1 - c;
+        Affine r;
+        r.m[0][0] = c + a.x * a.x * k;
+        r.m[0][1] = a.x * a.y * k - a.z * s;
+        r.m[0][2] = a.x * a.z * k + a.y * s;
+        r.m[1][0] = a.y * a.x * k + a.z * s;
+        r.m[1][1] = c + a.y * a.y * k;
+        r.m[1][2] = a.y * a.z * k - a.x * s;
+        r.m[2][0] = a.z * a.x * k - a.y * s;
+        r.m[2][1] = a.z * a.y * k + a.x * s;
+        r.m[2][2] = c + a.z * a.z * k;
+        return r;
+    }
+};
@@ -0,0 +1,676 @@
+#pragma once
+#include "bvh.h"
+#include "input.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Packed meshes for geometry that should not all be in memory at once. --pack-mesh writes a
+// mesh as clusters of up to kClusterTriangles triangles, one per leaf of a BVH over its
+// faces, stored in the BVH's depth-first leaf order so clusters that are close in space are
+// close on disk. A scene loads the file with `meshfile`, which only reads the cluster table;
+// a cluster's triangles are read when a ray first enters its box and stay resident in
+// GeometryCache, which drops the least recently used clusters beyond --geometry-budget.
+// With --wavefront the rays of a bounce, and then their shadow rays, are intersected cluster
+// by cluster (IntersectBatch, AnswerShadows) over a band of rows per thread, so a budget
+// smaller than the mesh costs one read per cluster and batch, not one per ray.
+//
+// Layout, in native byte order: MeshFileHeader, the texture path, one PackedCluster per
+// cluster, then the triangles of each cluster back to back. Coordinates are float in every
+// build; a mesh lives in its own coordinates, which instances place in the scene.
+//
+// With --pack-bits 16 or 32 the triangles are QuantizedTriangles instead of PackedTriangles,
+// 48 or 64 bytes instead of 100: positions on a lattice shared by the whole mesh, normals
+// octahedral in 2x16 bits and texture coordinates 16-bit fixed point over the cluster's
+// range. A vertex shared by two clusters lands on the same lattice point in both, so the
+// mesh stays watertight. Positions are decoded when a cluster is loaded; normals and texture
+// coordinates stay encoded in memory until a ray's final hit needs them.
+
+constexpr int kClusterTriangles = 256;
+
+struct MeshFileHeader
+{
+    uint32_t magic;
+    uint32_t cluster_count;
+    uint64_t triangle_count;
+    // diffuse, specular, k_ambient, k_diffuse, k_specular, exponent, alpha, eta
+    float material[12];
+    uint32_t texture_path_length;
+    // bits per quantized coordinate, 0 for float PackedTriangles
+    uint32_t position_bits;
+    // a lattice point p stands for origin + p * step
+    double origin[3];
+    double step;
+};
+
+struct PackedCluster
+{
+    float min[3], max[3];
+    uint64_t offset;
+    // index of the cluster's first triangle in the whole mesh
+    uint32_t first;
+    uint32_t count;
+    // quantized files: lattice point the coordinates are relative to, texture coordinate range
+    int64_t lattice[3];
+    float uv_min[2], uv_max[2];
+};
+
+struct PackedTriangle
+{
+    float pos[3][3];
+    float normal[3][3];
+    float uv[3][2];
+    uint32_t has_normals;
+};
+
+template <typename Q>
+struct QuantizedTriangle
+{
+    Q pos[3][3];
+    uint16_t uv[3][2];
+    uint32_t normal[3];
+    uint32_t has_normals;
+};
+
+// unit vector folded onto the octahedron |x| + |y| + |z| = 1, then flattened onto the square
+// [-1, 1]^2 (the lower half is unfolded into the corners), 16 bits per axis
+inline uint32_t EncodeOctahedral(const Vec3 &n)
+{
+    Real l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (l1 == 0)
+    {
+        return 0;
+    }
+    Real x = n.x / l1, y = n.y / l1;
+    if (n.z < 0)
+    {
+        Real fx = (1 - std::abs(y)) * (x < 0 ? -1 : 1);
+        Real fy = (1 - std::abs(x)) * (y < 0 ? -1 : 1);
+        x = fx;
+        y = fy;
+    }
+    auto quantize = [](Real v)
+    {
+        return (uint32_t)std::lround(std::clamp((v + 1) * Real(0.5), Real(0), Real(1)) * 65535);
+    };
+    return quantize(x) | quantize(y) << 16;
+}
+
+inline Vec3 DecodeOctahedral(uint32_t bits)
+{
+    if (bits == 0)
+    {
+        return Vec3(0, 0, 0);
+    }
+    Real x = (bits & 0xFFFF) / Real(65535) * 2 - 1;
+    Real y = (bits >> 16) / Real(65535) * 2 - 1;
+    Real z = 1 - std::abs(x) - std::abs(y);
+    if (z < 0)
+    {
+        Real fx = (1 - std::abs(y)) * (x < 0 ? -1 : 1);
+        Real fy = (1 - std::abs(x)) * (y < 0 ? -1 : 1);
+        x = fx;
+        y = fy;
+    }
+    return Vec3::Normalize(Vec3(x, y, z));
+}
+
+// a triangle of a quantized cluster, with its normals and texture coordinates still encoded
+struct CompactTriangle
+{
+    Point pos[3];
+    uint32_t normal[3];
+    uint16_t uv[3][2];
+    bool has_normals;
+};
+
+inline AABB PrimitiveBounds(const CompactTriangle *triangle)
+{
+    AABB box;
+    for (const Point &p : triangle->pos)
+    {
+        box.Grow(p);
+    }
+    return box;
+}
+
+// The resident triangles of one cluster with a BVH over them: Faces for a float file,
+// CompactTriangles for a quantized one.
+struct MeshCluster
+{
+    std::vector<Face> faces;
+    BVH bvh;
+    std::vector<CompactTriangle> compact;
+    BasicBVH<const CompactTriangle *> compact_bvh;
+    // index of the first triangle in the whole mesh
+    int first = 0;
+    float uv_min[2] = {0, 0}, uv_max[2] = {0, 0};
+
+    size_t Bytes() const
+    {
+        return faces.size() * sizeof(Face) + compact.size() * sizeof(CompactTriangle);
+    }
+    // compact triangle i with everything decoded, as it would have been loaded from a float file
+    std::shared_ptr<Face> DecodeFace(int i) const
+    {
+        const CompactTriangle &t = compact[i];
+        Vertex v[3];
+        for (int k = 0; k < 3; k++)
+        {
+            v[k].pos = t.pos[k];
+            v[k].normal = DecodeOctahedral(t.normal[k]);
+            v[k].texture_coord = std::make_pair(uv_min[0] + t.uv[k][0] * ((uv_max[0] - uv_min[0]) / 65535.0f),
+                                                uv_min[1] + t.uv[k][1] * ((uv_max[1] - uv_min[1]) / 65535.0f));
+        }
+        auto face = std::make_shared<Face>(v[0], v[1], v[2], Material(), t.has_normals);
+        face->index = first + i;
+        return face;
+    }
+};
+
+// One packed mesh: the cluster table and a BVH over the cluster boxes. Faces loaded from it
+// carry their index in the whole mesh in Object::index.
+class MeshFile
+{
+public:
+    static constexpr uint32_t kMagic = 0x3248534d; // "MSH2"
+
+    struct Cluster
+    {
+        AABB bounds;
+        uint64_t offset;
+        int first;
+        int count;
+        // in GeometryCache
+        int handle;
+        int64_t lattice[3];
+        float uv_min[2], uv_max[2];
+    };
+    std::string path;
+    std::vector<Cluster> clusters;
+    BasicBVH<const Cluster *> bvh;
+    uint64_t triangle_count = 0;
+    int position_bits = 0;
+    double origin[3] = {0, 0, 0};
+    double step = 0;
+
+    // the resident triangles of `cluster`, read from disk if needed
+    std::shared_ptr<const MeshCluster> Acquire(const Cluster &cluster) const;
+    // cluster holding triangle `index`
+    const Cluster &ClusterOf(int index) const
+    {
+        auto it = std::upper_bound(clusters.begin(), clusters.end(), index, [](int i, const Cluster &c)
+                                   { return i < c.first; });
+        return *(it - 1);
+    }
+    std::shared_ptr<const MeshCluster> Load(const Cluster &cluster) const
+    {
+        if (position_bits == 16)
+        {
+            return loadQuantized<uint16_t>(cluster);
+        }
+        if (position_bits == 32)
+        {
+            return loadQuantized<uint32_t>(cluster);
+        }
+        std::vector<PackedTriangle> packed = read<PackedTriangle>(cluster);
+        auto loaded = std::make_shared<MeshCluster>();
+        loaded->first = cluster.first;
+        loaded->faces.reserve(packed.size());
+        for (int i = 0; i < cluster.count; i++)
+        {
+            const PackedTriangle &p = packed[i];
+            Vertex v[3];
+            for (int k = 0; k < 3; k++)
+            {
+                v[k].pos = Point(p.pos[k][0], p.pos[k][1], p.pos[k][2]);
+                v[k].normal = Vec3(p.normal[k][0], p.normal[k][1], p.normal[k][2]);
+                v[k].texture_coord = std::make_pair(p.uv[k][0], p.uv[k][1]);
+            }
+            loaded->faces.emplace_back(v[0], v[1], v[2], Material(), p.has_normals != 0);
+            loaded->faces.back().index = cluster.first + i;
+        }
+        std::vector<Object *> faces;
+        for (Face &face : loaded->faces)
+        {
+            faces.push_back(&face);
+        }
+        loaded->bvh.Build(faces);
+        return loaded;
+    }
+
+private:
+    template <typename T>
+    std::vector<T> read(const Cluster &cluster) const
+    {
+        std::vector<T> records(cluster.count);
+        std::ifstream file(path, std::ios::binary);
+        file.seekg((std::streamoff)cluster.offset);
+        if (!file.read(reinterpret_cast<char *>(records.data()), records.size() * sizeof(T)))
+        {
+            std::cerr << "Failed to read " << path << std::endl;
+            exit(1);
+        }
+        return records;
+    }
+    template <typename Q>
+    std::shared_ptr<const MeshCluster> loadQuantized(const Cluster &cluster) const
+    {
+        std::vector<QuantizedTriangle<Q>> packed = read<QuantizedTriangle<Q>>(cluster);
+        auto loaded = std::make_shared<MeshCluster>();
+        loaded->first = cluster.first;
+        std::copy(cluster.uv_min, cluster.uv_min + 2, loaded->uv_min);
+        std::copy(cluster.uv_max, cluster.uv_max + 2, loaded->uv_max);
+        loaded->compact.resize(packed.size());
+        for (int i = 0; i < cluster.count; i++)
+        {
+            const QuantizedTriangle<Q> &p = packed[i];
+            CompactTriangle &t = loaded->compact[i];
+            for (int k = 0; k < 3; k++)
+            {
+                t.pos[k] = DecodeLattice(cluster.lattice, p.pos[k]);
+                t.normal[k] = p.normal[k];
+                t.uv[k][0] = p.uv[k][0];
+                t.uv[k][1] = p.uv[k][1];
+            }
+            t.has_normals = p.has_normals != 0;
+        }
+        std::vector<const CompactTriangle *> triangles;
+        for (const CompactTriangle &t : loaded->compact)
+        {
+            triangles.push_back(&t);
+        }
+        loaded->compact_bvh.Build(triangles);
+        return loaded;
+    }
+
+public:
+    // position of a lattice point given relative to `base`; the same lattice point decodes
+    // to the same position from every cluster
+    template <typename Q>
+    Point DecodeLattice(const int64_t *base, const Q *q) const
+    {
+        return Point((Real)(origin[0] + (double)(base[0] + (int64_t)q[0]) * step),
+                     (Real)(origin[1] + (double)(base[1] + (int64_t)q[1]) * step),
+                     (Real)(origin[2] + (double)(base[2] + (int64_t)q[2]) * step));
+    }
+};
+
+inline AABB PrimitiveBounds(const MeshFile::Cluster *cluster)
+{
+    return cluster->bounds;
+}
+
+// Process-wide store of resident clusters, shared by every packed mesh. Like TextureCache,
+// files are deduplicated by path, and a cluster that is dropped while a ray still uses it
+// stays alive through the shared_ptr handed out by Acquire.
+class GeometryCache
+{
+public:
+    static GeometryCache &Global()
+    {
+        static GeometryCache cache;
+        return cache;
+    }
+    // budget in bytes of expanded triangles, 0 means unlimited
+    void SetBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        evict(-1);
+    }
+    // the file at `path` with its cluster table read, opened once per path
+    std::shared_ptr<MeshFile> Open(const std::string &path, MeshFileHeader &header, std::string &texture_path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<PackedCluster> packed;
+        if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != MeshFile::kMagic)
+        {
+            std::cerr << "Invalid mesh file " << path << std::endl;
+            exit(1);
+        }
+        texture_path.assign(header.texture_path_length, '\0');
+        packed.resize(header.cluster_count);
+        if (!file.read(texture_path.data(), texture_path.size()) ||
+            !file.read(reinterpret_cast<char *>(packed.data()), packed.size() * sizeof(PackedCluster)))
+        {
+            std::cerr << "Invalid mesh file " << path << std::endl;
+            exit(1);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_path.find(path);
+        if (it != by_path.end())
+        {
+            return it->second;
+        }
+        auto mesh = std::make_shared<MeshFile>();
+        mesh->path = path;
+        mesh->triangle_count = header.triangle_count;
+        mesh->position_bits = (int)header.position_bits;
+        std::copy(header.origin, header.origin + 3, mesh->origin);
+        mesh->step = header.step;
+        for (const PackedCluster &p : packed)
+        {
+            MeshFile::Cluster cluster;
+            cluster.bounds.Grow(Point(p.min[0], p.min[1], p.min[2]));
+            cluster.bounds.Grow(Point(p.max[0], p.max[1], p.max[2]));
+            cluster.offset = p.offset;
+            cluster.first = (int)p.first;
+            cluster.count = (int)p.count;
+            cluster.handle = (int)entries.size();
+            std::copy(p.lattice, p.lattice + 3, cluster.lattice);
+            std::copy(p.uv_min, p.uv_min + 2, cluster.uv_min);
+            std::copy(p.uv_max, p.uv_max + 2, cluster.uv_max);
+            mesh->clusters.push_back(cluster);
+            entries.push_back(std::make_unique<Entry>());
+            entries.back()->file = mesh.get();
+        }
+        std::vector<const MeshFile::Cluster *> clusters;
+        for (const auto &cluster : mesh->clusters)
+        {
+            clusters.push_back(&cluster);
+        }
+        mesh->bvh.Build(clusters, 1);
+        by_path[path] = mesh;
+        return mesh;
+    }
+    std::shared_ptr<const MeshCluster> Acquire(const MeshFile::Cluster &cluster)
+    {
+        Entry *entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            entry = entries[cluster.handle].get();
+            entry->last_use = ++clock;
+            if (entry->cluster)
+            {
+                hits++;
+                return entry->cluster;
+            }
+        }
+        // read outside the cache lock so other clusters stay available meanwhile
+        std::lock_guard<std::mutex> load_lock(entry->load_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (entry->cluster)
+            {
+                hits++;
+                return entry->cluster;
+            }
+        }
+        auto loaded = entry->file->Load(cluster);
+        std::lock_guard<std::mutex> lock(mutex);
+        entry->cluster = loaded;
+        entry->bytes = loaded->Bytes();
+        resident += entry->bytes;
+        resident_entries.push_back(cluster.handle);
+        loads++;
+        evict(cluster.handle);
+        return loaded;
+    }
+    void PrintStats(std::ostream &os)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.empty())
+        {
+            return;
+        }
+        os << "geometry: " << entries.size() << " clusters, " << loads << " loads, " << evictions << " evictions, "
+           << hits << " hits, " << resident / (1024 * 1024) << " MB resident" << std::endl;
+    }
+
+private:
+    struct Entry
+    {
+        const MeshFile *file = nullptr;
+        std::shared_ptr<const MeshCluster> cluster;
+        std::mutex load_mutex;
+        uint64_t last_use = 0;
+        size_t bytes = 0;
+    };
+    // drop least recently used clusters until under budget, never touching `keep`
+    void evict(int keep)
+    {
+        while (budget != 0 && resident > budget)
+        {
+            int victim = -1;
+            for (int i = 0; i < (int)resident_entries.size(); i++)
+            {
+                int e = resident_entries[i];
+                if (e != keep && (victim == -1 || entries[e]->last_use < entries[resident_entries[victim]]->last_use))
+                {
+                    victim = i;
+                }
+            }
+            if (victim == -1)
+            {
+                return;
+            }
+            Entry &entry = *entries[resident_entries[victim]];
+            entry.cluster.reset();
+            resident -= entry.bytes;
+            evictions++;
+            resident_entries[victim] = resident_entries.back();
+            resident_entries.pop_back();
+        }
+    }
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Entry>> entries;
+    std::vector<int> resident_entries;
+    std::map<std::string, std::shared_ptr<MeshFile>> by_path;
+    size_t budget = 0;
+    size_t resident = 0;
+    uint64_t clock = 0;
+    uint64_t hits = 0, loads = 0, evictions = 0;
+};
+
+inline std::shared_ptr<const MeshCluster> MeshFile::Acquire(const Cluster &cluster) const
+{
+    return GeometryCache::Global().Acquire(cluster);
+}
+
+std::string OpenMeshFile(const std::string &path, Mesh &mesh)
+{
+    MeshFileHeader header;
+    std::string texture_path;
+    mesh.file = GeometryCache::Global().Open(path, header, texture_path);
+    mesh.bounds = mesh.file->bvh.Bounds();
+    const float *m = header.material;
+    mesh.material = Material(Color(m[0], m[1], m[2]), Color(m[3], m[4], m[5]), m[6], m[7], m[8], m[9], m[11], m[10]);
+    return texture_path;
+}
+
+// quantized records of one cluster's faces, positions relative to the cluster's lattice point
+template <typename Q>
+void QuantizeCluster(Object *const *first, int count, const MeshFileHeader &header, PackedCluster &cluster,
+                     std::vector<char> &out)
+{
+    auto lattice = [&](const Point &p, int axis)
+    { return std::llround(((double)(&p.x)[axis] - header.origin[axis]) / header.step); };
+    const Vertex &corner = static_cast<const Face &>(*first[0]).v0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        cluster.lattice[axis] = lattice(corner.pos, axis);
+    }
+    cluster.uv_min[0] = cluster.uv_max[0] = corner.texture_coord.first;
+    cluster.uv_min[1] = cluster.uv_max[1] = corner.texture_coord.second;
+    for (int i = 0; i < count; i++)
+    {
+        const Face &face = static_cast<const Face &>(*first[i]);
+        for (const Vertex *v : {&face.v0, &face.v1, &face.v2})
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                cluster.lattice[axis] = std::min<int64_t>(cluster.lattice[axis], lattice(v->pos, axis));
+            }
+            for (int axis = 0; axis < 2; axis++)
+            {
+                float uv = axis == 0 ? v->texture_coord.first : v->texture_coord.second;
+                cluster.uv_min[axis] = std::min(cluster.uv_min[axis], uv);
+                cluster.uv_max[axis] = std::max(cluster.uv_max[axis], uv);
+            }
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        const Face &face = static_cast<const Face &>(*first[i]);
+        QuantizedTriangle<Q> t;
+        std::memset(&t, 0, sizeof(t));
+        const Vertex *v[3] = {&face.v0, &face.v1, &face.v2};
+        for (int k = 0; k < 3; k++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                t.pos[k][axis] = (Q)(lattice(v[k]->pos, axis) - cluster.lattice[axis]);
+            }
+            float uv[2] = {v[k]->texture_coord.first, v[k]->texture_coord.second};
+            for (int axis = 0; axis < 2; axis++)
+            {
+                float range = cluster.uv_max[axis] - cluster.uv_min[axis];
+                t.uv[k][axis] = range > 0 ? (uint16_t)std::lround((uv[axis] - cluster.uv_min[axis]) / range * 65535) : 0;
+            }
+            t.normal[k] = EncodeOctahedral(v[k]->normal);
+        }
+        t.has_normals = face.has_normals;
+        const char *bytes = reinterpret_cast<const char *>(&t);
+        out.insert(out.end(), bytes, bytes + sizeof(t));
+    }
+}
+
+// Write `mesh` as a packed mesh file; texture_path is "" for an untextured mesh. position_bits
+// is 0 for float triangles, or 16 or 32 for quantized ones. Returns false if the file could
+// not be written.
+bool WriteMeshFile(const Mesh &mesh, const std::string &texture_path, const std::string &path, int position_bits = 0)
+{
+    std::vector<Object *> faces;
+    for (const auto &face : mesh.faces)
+    {
+        faces.push_back(face.get());
+    }
+    BVH clusters;
+    clusters.Build(faces, kClusterTriangles);
+    std::vector<std::pair<Object *const *, int>> leaves;
+    clusters.ForEachLeaf([&](Object *const *first, int count)
+                         { leaves.emplace_back(first, count); });
+
+    MeshFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = MeshFile::kMagic;
+    header.triangle_count = faces.size();
+    const Material &m = mesh.material;
+    float material[12] = {m.diffuse.R, m.diffuse.G, m.diffuse.B, m.specular.R, m.specular.G, m.specular.B,
+                          m.k_ambient, m.k_diffuse, m.k_specular, m.specular_exponent, m.alpha, m.eta};
+    std::memcpy(header.material, material, sizeof(material));
+    header.texture_path_length = (uint32_t)texture_path.size();
+    header.position_bits = (uint32_t)position_bits;
+    if (position_bits != 0)
+    {
+        // one step for the whole mesh, fine enough that the largest cluster spans 2^bits - 2
+        // steps; the extra step covers rounding at both ends
+        AABB bounds = clusters.Bounds();
+        double extent = 0;
+        for (const auto &leaf : leaves)
+        {
+            AABB box;
+            for (int i = 0; i < leaf.second; i++)
+            {
+                box.Grow(ObjectBounds(*leaf.first[i]));
+            }
+            Vec3 size = box.max - box.min;
+            extent = std::max({extent, (double)size.x, (double)size.y, (double)size.z});
+        }
+        header.origin[0] = bounds.min.x;
+        header.origin[1] = bounds.min.y;
+        header.origin[2] = bounds.min.z;
+        header.step = extent > 0 ? extent / (std::ldexp(1.0, position_bits) - 2) : 1;
+    }
+
+    std::vector<PackedCluster> table;
+    std::vector<char> triangles;
+    uint32_t triangle_count = 0;
+    MeshFile decoder;
+    std::copy(header.origin, header.origin + 3, decoder.origin);
+    decoder.step = header.step;
+    for (const auto &[first, count] : leaves)
+    {
+        PackedCluster cluster;
+        std::memset(&cluster, 0, sizeof(cluster));
+        cluster.first = triangle_count;
+        cluster.count = (uint32_t)count;
+        cluster.offset = triangles.size();
+        triangle_count += count;
+        AABB bounds;
+        if (position_bits == 0)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                const Face &face = static_cast<const Face &>(*first[i]);
+                bounds.Grow(ObjectBounds(face));
+                PackedTriangle t;
+                std::memset(&t, 0, sizeof(t));
+                const Vertex *v[3] = {&face.v0, &face.v1, &face.v2};
+                for (int k = 0; k < 3; k++)
+                {
+                    float pos[3] = {(float)v[k]->pos.x, (float)v[k]->pos.y, (float)v[k]->pos.z};
+                    float normal[3] = {(float)v[k]->normal.x, (float)v[k]->normal.y, (float)v[k]->normal.z};
+                    std::memcpy(t.pos[k], pos, sizeof(pos));
+                    std::memcpy(t.normal[k], normal, sizeof(normal));
+                    t.uv[k][0] = v[k]->texture_coord.first;
+                    t.uv[k][1] = v[k]->texture_coord.second;
+                }
+                t.has_normals = face.has_normals;
+                const char *bytes = reinterpret_cast<const char *>(&t);
+                triangles.insert(triangles.end(), bytes, bytes + sizeof(t));
+            }
+        }
+        else
+        {
+            // the box of the positions as they will be decoded, not as they were written
+            auto grow = [&](const auto *records)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    for (int k = 0; k < 3; k++)
+                    {
+                        bounds.Grow(decoder.DecodeLattice(cluster.lattice, records[i].pos[k]));
+                    }
+                }
+            };
+            if (position_bits == 16)
+            {
+                QuantizeCluster<uint16_t>(first, count, header, cluster, triangles);
+                grow(reinterpret_cast<const QuantizedTriangle<uint16_t> *>(triangles.data() + cluster.offset));
+            }
+            else
+            {
+                QuantizeCluster<uint32_t>(first, count, header, cluster, triangles);
+                grow(reinterpret_cast<const QuantizedTriangle<uint32_t> *>(triangles.data() + cluster.offset));
+            }
+        }
+        float lo[3] = {(float)bounds.min.x, (float)bounds.min.y, (float)bounds.min.z};
+        float hi[3] = {(float)bounds.max.x, (float)bounds.max.y, (float)bounds.max.z};
+        std::memcpy(cluster.min, lo, sizeof(lo));
+        std::memcpy(cluster.max, hi, sizeof(hi));
+        table.push_back(cluster);
+    }
+    header.cluster_count = (uint32_t)table.size();
+    uint64_t data = sizeof(header) + texture_path.size() + table.size() * sizeof(PackedCluster);
+    for (PackedCluster &cluster : table)
+    {
+        cluster.offset += data;
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(texture_path.data(), texture_path.size());
+    file.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(PackedCluster));
+    file.write(triangles.data(), triangles.size());
+    return (bool)file;
+}
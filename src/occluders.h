@@ -0,0 +1,95 @@
+#pragma once
+#include "input.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Last opaque object that blocked a shadow ray, one per light and per thread. Neighbouring
+// shading points are usually shadowed by the same object, so testing it first lets most rays
+// into a shadow skip the BVH. Only fully opaque objects are cached: any one of them on the
+// ray blocks all of the light, whatever else the ray passes through.
+class OccluderCache
+{
+public:
+    // the calling thread's cache, reset when it is used with another scene or light count
+    static OccluderCache &Local(const InputFileData &input)
+    {
+        thread_local OccluderCache *cache = nullptr;
+        if (!cache)
+        {
+            // kept alive for the whole run so PrintStats can still read it after threads exit
+            cache = new OccluderCache();
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            registry().push_back(cache);
+        }
+        if (cache->owner != &input || cache->last.size() != input.lights.size())
+        {
+            cache->owner = &input;
+            cache->last.assign(input.lights.size(), nullptr);
+        }
+        return *cache;
+    }
+    Object *Get(int light) const
+    {
+        return last[light];
+    }
+    void Set(int light, Object *object)
+    {
+        last[light] = object;
+    }
+    // one call per shadow ray; counters are only written by the owning thread, the relaxed
+    // atomics just let PrintStats read them
+    void Count(bool hit, bool blocked)
+    {
+        bump(rays);
+        if (blocked)
+        {
+            bump(blocked_rays);
+        }
+        if (hit)
+        {
+            bump(hits);
+        }
+    }
+    static void PrintStats(std::ostream &os)
+    {
+        uint64_t total_rays = 0, total_blocked = 0, total_hits = 0;
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        for (const OccluderCache *cache : registry())
+        {
+            total_rays += cache->rays.load(std::memory_order_relaxed);
+            total_blocked += cache->blocked_rays.load(std::memory_order_relaxed);
+            total_hits += cache->hits.load(std::memory_order_relaxed);
+        }
+        os << "shadow occluders: " << total_rays << " shadow rays, " << total_blocked << " blocked, " << total_hits
+           << " by the cached occluder";
+        if (total_blocked > 0)
+        {
+            os << " (" << (100 * total_hits / total_blocked) << "% of blocked)";
+        }
+        os << std::endl;
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> &counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    static std::vector<OccluderCache *> &registry()
+    {
+        static std::vector<OccluderCache *> caches;
+        return caches;
+    }
+    static std::mutex &registry_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+    const InputFileData *owner = nullptr;
+    std::vector<Object *> last;
+    std::atomic<uint64_t> rays{0};
+    std::atomic<uint64_t> blocked_rays{0};
+    std::atomic<uint64_t> hits{0};
+};
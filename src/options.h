@@ -0,0 +1,331 @@
+#pragma once
+#include "tonemap.h"
+#include "view.h"
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// change to the scene a render server keeps loaded; travels with a request like ViewOverride
+enum EditKind : uint32_t
+{
+    EDIT_NONE = 0,
+    EDIT_MOVE = 1,
+    EDIT_MATERIAL = 2
+};
+struct SceneEdit
+{
+    uint32_t kind = EDIT_NONE;
+    // index of the object in scene file order
+    int32_t object = -1;
+    double translate[3] = {0, 0, 0};
+    // mtlcolor values in scene file order: diffuse rgb, specular rgb, ka kd ks n alpha eta
+    double material[12] = {0};
+};
+
+// command line settings that are not part of the scene file
+struct RenderOptions
+{
+    std::string input_file;
+    // texture cache budget in bytes, 0 means unlimited
+    size_t texture_budget = 0;
+    // resident packed mesh clusters in bytes, 0 means unlimited
+    size_t geometry_budget = 0;
+    // write mesh pack_mesh of the scene to pack_file instead of rendering, see meshfile.h
+    std::string pack_mesh;
+    std::string pack_file;
+    // bits per quantized position in the packed file, 0 for plain floats
+    int pack_bits = 0;
+    bool print_stats = false;
+    // worker threads including the main one, 0 means one per usable CPU
+    int threads = 0;
+    // bind threads to CPUs and give each NUMA node its own band of tiles
+    bool pin_threads = false;
+    // 8-bit output, see ToneMap
+    float exposure = 0;
+    ToneMap::Curve curve = ToneMap::LINEAR;
+    float gamma = 2.2f;
+    bool dither = false;
+    ViewOverride view;
+    SceneEdit edit;
+    // keep the scene loaded and answer render requests on this Unix socket
+    std::string serve_socket;
+    // send one render request to a server instead of rendering locally
+    std::string client_socket;
+    std::string output_file;
+    // frame sequence sidecar, see animation.h
+    std::string animation_file;
+    // tile distribution through a shared directory, see tiles.h
+    std::string split_dir;
+    std::string worker_dir;
+    std::string merge_dir;
+    int tile_size = 64;
+    // tiles sent as they finish, and the reader for such a stream, see stream.h
+    std::string stream_path;
+    std::string reassemble_path;
+    // first-hit cache for re-lighting, see gbuffer.h
+    std::string gbuffer_file;
+    bool wavefront = false;
+    // primary rays traverse every object instead of the ones in the view frustum
+    bool no_cull = false;
+    // lights sampled per shading point, 0 for all of them
+    int light_samples = 0;
+    int area_samples = 32;
+};
+
+static void print_usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " inputfile [options]" << std::endl;
+    std::cerr << "       " << prog << " inputfile --serve SOCKET [options]" << std::endl;
+    std::cerr << "       " << prog << " inputfile --animate FRAMES [options] [-o base]" << std::endl;
+    std::cerr << "       " << prog << " --client SOCKET [view options] [-o out.ppm]" << std::endl;
+    std::cerr << "       " << prog << " inputfile --split DIR [--tile-size N] [view options]" << std::endl;
+    std::cerr << "       " << prog << " inputfile --worker DIR [view options]" << std::endl;
+    std::cerr << "       " << prog << " --merge DIR [-o out.ppm]" << std::endl;
+    std::cerr << "       " << prog << " inputfile --stream PATH|- [options]" << std::endl;
+    std::cerr << "       " << prog << " --reassemble PATH|- [-o out.ppm]" << std::endl;
+    std::cerr << "  --texture-budget MB   keep at most MB megabytes of decoded textures resident" << std::endl;
+    std::cerr << "  --geometry-budget MB  keep at most MB megabytes of packed mesh clusters resident" << std::endl;
+    std::cerr << "  --pack-mesh NAME FILE write mesh NAME of the scene to FILE for `meshfile` and exit" << std::endl;
+    std::cerr << "  --pack-bits N         with --pack-mesh, quantize positions to N = 16 or 32 bits" << std::endl;
+    std::cerr << "  --stats               print cache statistics after rendering" << std::endl;
+    std::cerr << "  --threads N           use N threads (default: one per CPU available to the process)" << std::endl;
+    std::cerr << "  --pin                 pin threads to CPUs, spread over NUMA nodes" << std::endl;
+    std::cerr << "  --exposure STOPS      scale the image by 2^STOPS before writing it" << std::endl;
+    std::cerr << "  --gamma G  --srgb     encode output with a 1/G power curve or the sRGB curve" << std::endl;
+    std::cerr << "  --dither              ordered dithering when quantizing to 8 bits" << std::endl;
+    std::cerr << "  --light-samples K     shade K lights per point, picked by estimated contribution" << std::endl;
+    std::cerr << "  --area-samples N      shadow rays per area light where it is partly hidden (default 32)" << std::endl;
+    std::cerr << "  --gbuffer FILE        reuse first hits from FILE if only lights or materials changed" << std::endl;
+    std::cerr << "  --wavefront           trace one bounce at a time in sorted batches instead of per pixel" << std::endl;
+    std::cerr << "  --no-cull             do not cull primary rays to the view frustum" << std::endl;
+    std::cerr << "view options:" << std::endl;
+    std::cerr << "  --eye X Y Z  --viewdir X Y Z  --updir X Y Z  --hfov DEG  --imsize W H" << std::endl;
+    std::cerr << "  --region X0 Y0 X1 Y1  render only pixels X0 <= x < X1, Y0 <= y < Y1" << std::endl;
+    std::cerr << "client edits, applied to the server's scene before rendering:" << std::endl;
+    std::cerr << "  --move I DX DY DZ     translate object I" << std::endl;
+    std::cerr << "  --mtlcolor I <12 mtlcolor values>  replace the material of object I" << std::endl;
+}
+
+static bool parse_doubles(int argc, char *argv[], int &i, double *out, int n)
+{
+    if (i + n >= argc)
+    {
+        return false;
+    }
+    for (int k = 0; k < n; k++)
+    {
+        char *end;
+        out[k] = std::strtod(argv[++i], &end);
+        if (*end != '\0')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool parse_ints(int argc, char *argv[], int &i, int32_t *out, int n)
+{
+    double values[4];
+    if (!parse_doubles(argc, argv, i, values, n))
+    {
+        return false;
+    }
+    for (int k = 0; k < n; k++)
+    {
+        out[k] = (int32_t)values[k];
+    }
+    return true;
+}
+
+RenderOptions parse_options(int argc, char *argv[])
+{
+    RenderOptions options;
+    ViewOverride &view = options.view;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool ok = true;
+        if (arg == "--texture-budget" && i + 1 < argc)
+        {
+            options.texture_budget = (size_t)(std::atof(argv[++i]) * 1024 * 1024);
+        }
+        else if (arg == "--geometry-budget" && i + 1 < argc)
+        {
+            options.geometry_budget = (size_t)(std::atof(argv[++i]) * 1024 * 1024);
+        }
+        else if (arg == "--pack-mesh" && i + 2 < argc)
+        {
+            options.pack_mesh = argv[++i];
+            options.pack_file = argv[++i];
+        }
+        else if (arg == "--pack-bits" && i + 1 < argc)
+        {
+            options.pack_bits = std::atoi(argv[++i]);
+            ok = options.pack_bits == 0 || options.pack_bits == 16 || options.pack_bits == 32;
+        }
+        else if (arg == "--stats")
+        {
+            options.print_stats = true;
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            options.threads = std::atoi(argv[++i]);
+            ok = options.threads > 0;
+        }
+        else if (arg == "--pin")
+        {
+            options.pin_threads = true;
+        }
+        else if (arg == "--exposure")
+        {
+            double stops = 0;
+            ok = parse_doubles(argc, argv, i, &stops, 1);
+            if (ok)
+            {
+                options.exposure = (float)stops;
+            }
+        }
+        else if (arg == "--gamma")
+        {
+            double gamma = 0;
+            ok = parse_doubles(argc, argv, i, &gamma, 1) && gamma > 0;
+            if (ok)
+            {
+                options.curve = ToneMap::GAMMA;
+                options.gamma = (float)gamma;
+            }
+        }
+        else if (arg == "--srgb")
+        {
+            options.curve = ToneMap::SRGB;
+        }
+        else if (arg == "--dither")
+        {
+            options.dither = true;
+        }
+        else if (arg == "--serve" && i + 1 < argc)
+        {
+            options.serve_socket = argv[++i];
+        }
+        else if (arg == "--client" && i + 1 < argc)
+        {
+            options.client_socket = argv[++i];
+        }
+        else if (arg == "--animate" && i + 1 < argc)
+        {
+            options.animation_file = argv[++i];
+        }
+        else if (arg == "--split" && i + 1 < argc)
+        {
+            options.split_dir = argv[++i];
+        }
+        else if (arg == "--worker" && i + 1 < argc)
+        {
+            options.worker_dir = argv[++i];
+        }
+        else if (arg == "--merge" && i + 1 < argc)
+        {
+            options.merge_dir = argv[++i];
+        }
+        else if (arg == "--stream" && i + 1 < argc)
+        {
+            options.stream_path = argv[++i];
+        }
+        else if (arg == "--reassemble" && i + 1 < argc)
+        {
+            options.reassemble_path = argv[++i];
+        }
+        else if (arg == "--tile-size" && i + 1 < argc)
+        {
+            options.tile_size = std::atoi(argv[++i]);
+        }
+        else if (arg == "--light-samples" && i + 1 < argc)
+        {
+            options.light_samples = std::atoi(argv[++i]);
+        }
+        else if (arg == "--area-samples" && i + 1 < argc)
+        {
+            options.area_samples = std::atoi(argv[++i]);
+            ok = options.area_samples > 0;
+        }
+        else if (arg == "--wavefront")
+        {
+            options.wavefront = true;
+        }
+        else if (arg == "--no-cull")
+        {
+            options.no_cull = true;
+        }
+        else if (arg == "--gbuffer" && i + 1 < argc)
+        {
+            options.gbuffer_file = argv[++i];
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            options.output_file = argv[++i];
+        }
+        else if (arg == "--eye")
+        {
+            ok = parse_doubles(argc, argv, i, view.eye, 3);
+            view.fields |= VIEW_EYE;
+        }
+        else if (arg == "--viewdir")
+        {
+            ok = parse_doubles(argc, argv, i, view.viewdir, 3);
+            view.fields |= VIEW_VIEWDIR;
+        }
+        else if (arg == "--updir")
+        {
+            ok = parse_doubles(argc, argv, i, view.updir, 3);
+            view.fields |= VIEW_UPDIR;
+        }
+        else if (arg == "--hfov")
+        {
+            ok = parse_doubles(argc, argv, i, &view.hfov, 1);
+            view.fields |= VIEW_HFOV;
+        }
+        else if (arg == "--imsize")
+        {
+            ok = parse_ints(argc, argv, i, view.imsize, 2);
+            view.fields |= VIEW_IMSIZE;
+        }
+        else if (arg == "--region")
+        {
+            ok = parse_ints(argc, argv, i, view.region, 4);
+            view.fields |= VIEW_REGION;
+        }
+        else if (arg == "--move" || arg == "--mtlcolor")
+        {
+            SceneEdit &edit = options.edit;
+            double index;
+            ok = parse_doubles(argc, argv, i, &index, 1) &&
+                 parse_doubles(argc, argv, i, arg == "--move" ? edit.translate : edit.material, arg == "--move" ? 3 : 12);
+            edit.kind = arg == "--move" ? EDIT_MOVE : EDIT_MATERIAL;
+            edit.object = (int32_t)index;
+        }
+        else if (arg.rfind("-", 0) == 0 || !options.input_file.empty())
+        {
+            ok = false;
+        }
+        else
+        {
+            options.input_file = arg;
+        }
+        if (!ok)
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    // a client only talks to a server that already has the scene, and merging or reassembling
+    // only reads tiles
+    bool needs_scene = options.client_socket.empty() && options.merge_dir.empty() && options.reassemble_path.empty();
+    if (options.input_file.empty() == needs_scene)
+    {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    return options;
+}
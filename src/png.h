@@ -0,0 +1,273 @@
+#pragma once
+#include "threadpool.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// 8-bit RGB PNG writer. Rows are filtered and compressed in strips of about kStripBytes, one
+// pool task per strip, the way pigz splits a file: each strip is a raw deflate stream primed
+// with the 32 KB of filtered data before it and ended with a sync flush (the last one with a
+// final block), so the strips concatenate into one valid stream, and each strip becomes its
+// own IDAT chunk. The zlib header and the Adler-32 of the whole image wrap the first and last
+// strip. Without zlib (HAVE_ZLIB is set by the makefile when it finds it) the strips are
+// stored uncompressed: still a valid PNG, just not a small one.
+struct Png
+{
+    static void Write(const std::string &name, int width, int height, const std::vector<uint8_t> &bytes,
+                      ThreadPool *pool = nullptr)
+    {
+        const size_t stride = (size_t)width * 3 + 1;
+        const int strip_rows = (int)std::max<size_t>(1, kStripBytes / stride);
+        const int strips = (height + strip_rows - 1) / strip_rows;
+        auto run = [&](int count, const std::function<void(int)> &fn)
+        {
+            if (pool)
+            {
+                pool->ParallelFor(count, fn);
+            }
+            else
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    fn(i);
+                }
+            }
+        };
+
+        // filter byte + filtered row, for every row
+        std::vector<uint8_t> filtered(stride * height);
+        run(strips, [&](int s)
+            {
+                int y1 = std::min((s + 1) * strip_rows, height);
+                for (int y = s * strip_rows; y < y1; y++)
+                {
+                    filterRow(&bytes[(size_t)y * width * 3], y > 0 ? &bytes[(size_t)(y - 1) * width * 3] : nullptr,
+                              width * 3, &filtered[(size_t)y * stride]);
+                }
+            });
+
+        std::vector<std::vector<uint8_t>> idat(strips);
+        std::vector<uint32_t> adler(strips);
+        run(strips, [&](int s)
+            {
+                size_t begin = (size_t)s * strip_rows * stride;
+                size_t end = std::min((size_t)(s + 1) * strip_rows, (size_t)height) * stride;
+                compressStrip(filtered, begin, end, s == strips - 1, idat[s], adler[s]);
+            });
+
+        // zlib header (deflate, 32 KB window, default level) and the big-endian Adler-32
+        idat[0].insert(idat[0].begin(), {0x78, 0x9C});
+        uint32_t checksum = adler[0];
+        for (int s = 1; s < strips; s++)
+        {
+            size_t length = std::min((size_t)(s + 1) * strip_rows, (size_t)height) * stride - (size_t)s * strip_rows * stride;
+            checksum = combineAdler(checksum, adler[s], length);
+        }
+        putBE32(idat.back(), checksum);
+
+        std::ofstream file(name, std::ios::out | std::ios::binary | std::ios::trunc);
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        file.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+        std::vector<uint8_t> header;
+        putBE32(header, width);
+        putBE32(header, height);
+        // 8 bits per channel, truecolor, deflate, adaptive filtering, no interlace
+        header.insert(header.end(), {8, 2, 0, 0, 0});
+        writeChunk(file, "IHDR", header);
+        for (const auto &chunk : idat)
+        {
+            writeChunk(file, "IDAT", chunk);
+        }
+        writeChunk(file, "IEND", {});
+        if (!file)
+        {
+            std::cerr << "Failed to write " << name << std::endl;
+        }
+    }
+
+private:
+    static constexpr size_t kStripBytes = 256 * 1024;
+    static constexpr size_t kWindow = 32 * 1024;
+
+    // pick the filter with the smallest sum of absolute (signed) residuals, as libpng does;
+    // prior is the unfiltered row above, or null for the first row
+    static void filterRow(const uint8_t *row, const uint8_t *prior, int n, uint8_t *out)
+    {
+        std::vector<uint8_t> zero_row;
+        if (!prior)
+        {
+            zero_row.assign(n, 0);
+            prior = zero_row.data();
+        }
+        std::vector<uint8_t> scratch(n);
+        uint64_t best_cost = UINT64_MAX;
+        for (int filter = 0; filter < 5; filter++)
+        {
+            // one loop per filter, so each vectorizes; the first pixel has no left neighbour
+            uint8_t *r = scratch.data();
+            switch (filter)
+            {
+            case 0:
+                std::copy(row, row + n, r);
+                break;
+            case 1:
+                std::copy(row, row + 3, r);
+                for (int i = 3; i < n; i++)
+                {
+                    r[i] = row[i] - row[i - 3];
+                }
+                break;
+            case 2:
+                for (int i = 0; i < n; i++)
+                {
+                    r[i] = row[i] - prior[i];
+                }
+                break;
+            case 3:
+                for (int i = 0; i < 3; i++)
+                {
+                    r[i] = row[i] - prior[i] / 2;
+                }
+                for (int i = 3; i < n; i++)
+                {
+                    r[i] = row[i] - (uint8_t)((row[i - 3] + prior[i]) / 2);
+                }
+                break;
+            case 4:
+                for (int i = 0; i < 3; i++)
+                {
+                    r[i] = row[i] - prior[i];
+                }
+                for (int i = 3; i < n; i++)
+                {
+                    r[i] = row[i] - paeth(row[i - 3], prior[i], prior[i - 3]);
+                }
+                break;
+            }
+            uint64_t cost = 0;
+            for (int i = 0; i < n; i++)
+            {
+                cost += r[i] < 128 ? r[i] : 256 - r[i];
+            }
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                out[0] = (uint8_t)filter;
+                std::copy(r, r + n, out + 1);
+            }
+        }
+    }
+    static uint8_t paeth(int a, int b, int c)
+    {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+
+    // filtered[begin, end) as a deflate stream that continues the one before it
+    static void compressStrip(const std::vector<uint8_t> &filtered, size_t begin, size_t end, bool last,
+                              std::vector<uint8_t> &out, uint32_t &adler)
+    {
+        const uint8_t *data = filtered.data() + begin;
+        size_t size = end - begin;
+#ifdef HAVE_ZLIB
+        z_stream z = {};
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        if (begin > 0)
+        {
+            size_t window = std::min(begin, kWindow);
+            deflateSetDictionary(&z, filtered.data() + begin - window, (uInt)window);
+        }
+        // room for the sync flush's empty stored block on top of the worst case
+        out.resize(deflateBound(&z, size) + 16);
+        z.next_in = const_cast<Bytef *>(data);
+        z.avail_in = (uInt)size;
+        z.next_out = out.data();
+        z.avail_out = (uInt)out.size();
+        deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+        out.resize(z.total_out);
+        deflateEnd(&z);
+        adler = (uint32_t)adler32(1, data, (uInt)size);
+#else
+        // stored blocks of at most 65535 bytes; only the image's very last block is final
+        out.clear();
+        size_t pos = 0;
+        do
+        {
+            size_t length = std::min<size_t>(size - pos, 65535);
+            bool final = last && pos + length == size;
+            out.push_back(final ? 1 : 0);
+            out.insert(out.end(), {(uint8_t)length, (uint8_t)(length >> 8), (uint8_t)~length, (uint8_t)(~length >> 8)});
+            out.insert(out.end(), data + pos, data + pos + length);
+            pos += length;
+        } while (pos < size);
+        uint32_t a = 1, b = 0;
+        for (size_t i = 0; i < size; i++)
+        {
+            a = (a + data[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        adler = (b << 16) | a;
+#endif
+    }
+    // Adler-32 of two concatenated pieces from the checksums of each
+    static uint32_t combineAdler(uint32_t first, uint32_t second, size_t second_length)
+    {
+#ifdef HAVE_ZLIB
+        return (uint32_t)adler32_combine(first, second, (z_off_t)second_length);
+#else
+        const uint32_t base = 65521;
+        uint32_t rem = (uint32_t)(second_length % base);
+        uint32_t a1 = first & 0xFFFF, b1 = first >> 16, a2 = second & 0xFFFF, b2 = second >> 16;
+        uint32_t a = (a1 + a2 + base - 1) % base;
+        uint32_t b = (uint32_t)(((uint64_t)rem * a1 + b1 + b2 + base - rem) % base);
+        return (b << 16) | a;
+#endif
+    }
+
+    static void putBE32(std::vector<uint8_t> &out, uint32_t v)
+    {
+        out.insert(out.end(), {(uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v});
+    }
+    static void writeChunk(std::ofstream &file, const char *type, const std::vector<uint8_t> &data)
+    {
+        std::vector<uint8_t> head;
+        putBE32(head, (uint32_t)data.size());
+        head.insert(head.end(), type, type + 4);
+        uint32_t crc = crc32Update(crc32Update(0xFFFFFFFF, head.data() + 4, 4), data.data(), data.size());
+        std::vector<uint8_t> tail;
+        putBE32(tail, crc ^ 0xFFFFFFFF);
+        file.write(reinterpret_cast<const char *>(head.data()), head.size());
+        file.write(reinterpret_cast<const char *>(data.data()), data.size());
+        file.write(reinterpret_cast<const char *>(tail.data()), tail.size());
+    }
+    static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t size)
+    {
+        static const std::vector<uint32_t> table = []
+        {
+            std::vector<uint32_t> t(256);
+            for (uint32_t n = 0; n < 256; n++)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                {
+                    c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                }
+                t[n] = c;
+            }
+            return t;
+        }();
+        for (size_t i = 0; i < size; i++)
+        {
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+};
@@ -3,107 +3,192 @@
 #include "image.h"
 #include "input.h"
 #include "color.h"
+#include "meshfile.h"
 
+#include <bit>
 #include <cmath>
+#include <cstdint>
+#include <limits>
 struct RayResult
 {
-    float t;
+    Real t;
     Vec3 interpolated_normal; 
     Vec3 interpolated_uv;
+    // unit normal of the surface itself and the hit point snapped back onto it,
+    // used to place the origins of secondary rays
+    Vec3 geometric_normal;
+    Point point;
     Object* object=nullptr;
+    // for an instance, the triangle of its mesh that was hit
+    const Face* face = nullptr;
+    // keeps the face resident while the hit is in use, if it came from a packed mesh
+    std::shared_ptr<const MeshCluster> cluster;
+    // A hit on a quantized mesh only records t, the triangle of `cluster` and its barycentric
+    // coordinates; Ray::Resolve decodes that one triangle into `decoded` and fills in the rest.
+    int triangle = -1;
+    Real alpha = 0, beta = 0;
+    std::shared_ptr<const Face> decoded;
     bool inside = false;
 };
 
+// Error bounds for OffsetRayOrigin: far from the origin the hit point error is a few ulps of
+// the coordinate, so the offset is a fixed number of ulps; close to zero a fixed absolute step
+// is used instead. Values follow Waechter and Binder, Ray Tracing Gems ch. 6, with the near
+// zero step scaled down by the extra mantissa bits for double.
+template <typename T> struct OffsetTraits;
+template <> struct OffsetTraits<float>
+{
+    typedef int32_t Int;
+    static constexpr float origin = 1.0f / 32.0f;
+    static constexpr float float_scale = 1.0f / 65536.0f;
+    static constexpr float int_scale = 256.0f;
+};
+template <> struct OffsetTraits<double>
+{
+    typedef int64_t Int;
+    static constexpr double origin = 1.0 / 32.0;
+    static constexpr double float_scale = 1.0 / 65536.0 / (1 << 29);
+    static constexpr double int_scale = 256.0;
+};
+
+inline Real OffsetComponent(Real p, Real n)
+{
+    typedef OffsetTraits<Real> Traits;
+    typename Traits::Int of = (typename Traits::Int)(Traits::int_scale * n);
+    Real p_i = std::bit_cast<Real>(std::bit_cast<typename Traits::Int>(p) + (p < 0 ? -of : of));
+    return std::abs(p) < Traits::origin ? p + Traits::float_scale * n : p_i;
+}
+
+// Move `p` off its surface along the geometric normal `n`, to the side `dir` leaves from, by
+// just more than the rounding error of the hit point. Works the same at 1e-3 and at 1e6.
+inline Point OffsetRayOrigin(const Point& p, const Vec3& n, const Vec3& dir)
+{
+    Vec3 side = Vec3::Dot(n, dir) < 0 ? -n : n;
+    return Point(OffsetComponent(p.x, side.x), OffsetComponent(p.y, side.y), OffsetComponent(p.z, side.z));
+}
+
 class Ray
 {
 public:
     Ray(Point origin, Vec3 direction) : origin(origin), direction(direction) {}
+    // ray leaving a surface hit, with its origin offset so it cannot re-hit that surface
+    Ray(const RayResult& hit, Vec3 direction)
+        : origin(OffsetRayOrigin(hit.point, hit.geometric_normal, direction)), direction(direction), origin_object(hit.object),
+          origin_face(hit.face), origin_index(hit.face ? hit.face->index : -1) {}
     Point origin;
     Vec3 direction;
+    // hits are accepted for t in (t_min, t_max]
+    Real t_min = 0;
+    Real t_max = std::numeric_limits<Real>::infinity();
+    // primitive the ray was spawned from; a planar one can never be hit again by this ray
+    const Object* origin_object = nullptr;
+    // and the mesh triangle within it, if origin_object is an instance
+    const Face* origin_face = nullptr;
+    int origin_index = -1;
+    // ray cone for texture filtering: footprint width at the origin and its growth per unit t
+    Real cone_width = 0;
+    Real cone_spread = 0;
+    Real FootprintAt(Real t) const {
+        return cone_width + cone_spread * t;
+    }
     // compute some distance along the ray at "time" t
-    Point at(float t)  {
+    Point at(Real t) const {
         return origin +  direction*t;
     }
 
-    float IntersectSphere(Sphere sphere) {
+    Real IntersectSphere(const Sphere& sphere) const {
         // Compute the coefficients of the quadratic equation
-        float a = Vec3::Dot(direction, direction);
-        float b = 2 * Vec3::Dot(direction, origin - sphere.pos);
-        float c = Vec3::Dot(origin - sphere.pos, origin - sphere.pos) - sphere.radius * sphere.radius;
+        Real a = Vec3::Dot(direction, direction);
+        Real b = 2 * Vec3::Dot(direction, origin - sphere.pos);
+        Real c = Vec3::Dot(origin - sphere.pos, origin - sphere.pos) - sphere.radius * sphere.radius;
         // Compute the discriminant
-        float discriminant = b * b - 4 * a * c;
+        Real discriminant = b * b - 4 * a * c;
         // If the discriminant is negative, there are no real roots
         if (discriminant < 0) {
             return -1;
         }
         // Compute the two roots
-        float t1 = (-b + sqrt(discriminant)) / (2 * a);
-        float t2 = (-b - sqrt(discriminant)) / (2 * a);
-        // If both roots are negative, the ray starts inside the sphere
-        if (t1 < 0 && t2 < 0) {
+        Real t1 = (-b + std::sqrt(discriminant)) / (2 * a);
+        Real t2 = (-b - std::sqrt(discriminant)) / (2 * a);
+        // If both roots are before t_min, the sphere is behind the ray
+        if (t1 < t_min && t2 < t_min) {
             return -1;
         }
-        if (t1 < 0) {
+        if (t1 < t_min) {
             return t2;
         }
-        if (t2 < 0) {
+        if (t2 < t_min) {
             return t1;
         }
-        return fmin(t1, t2);
+        return std::min(t1, t2);
     }
-    float IntersectTriangle(Face face, Vec3& interpolated_normal, Vec3& interpolated_uv)
+    // t of the hit on triangle p0 p1 p2 and the barycentric weights of p0 and p1, or -1
+    Real IntersectTriangle(const Point& p0, const Point& p1, const Point& p2, Real& alpha, Real& beta) const
     {
         // 1. Compute the normal of the triangle
-        Vec3 v0v1 = face.v1.pos - face.v0.pos;
-        Vec3 v0v2 = face.v2.pos - face.v0.pos;
+        Vec3 v0v1 = p1 - p0;
+        Vec3 v0v2 = p2 - p0;
         Vec3 N = v0v1.Cross(v0v2);
 
         // 2. Apply plane equation to find the intersection point
-        float d = Vec3::Dot(N, face.v0.pos);
+        Real d = Vec3::Dot(N, p0);
         if (Vec3::Dot(N, direction) == 0) {
             return -1;
         }
-        float t = (d - Vec3::Dot(N, origin)) / Vec3::Dot(N, direction);
-        if (t < 0) {
+        Real t = (d - Vec3::Dot(N, origin)) / Vec3::Dot(N, direction);
+        if (t < t_min) {
             return -1;
         }
         auto intersection = at(t);
 
         // 3. Check if the intersection point is inside the triangle using barycentric coordinates
         Vec3 C;
-        Vec3 edge0 = face.v1.pos - face.v0.pos;
-        Vec3 vp0 = intersection - face.v0.pos;
+        Vec3 edge0 = p1 - p0;
+        Vec3 vp0 = intersection - p0;
         C = edge0.Cross(vp0);
         if (Vec3::Dot(N, C) < 0) {
             return -1;
         }
-        Vec3 edge1 = face.v2.pos - face.v1.pos;
-        Vec3 vp1 = intersection - face.v1.pos;
+        Vec3 edge1 = p2 - p1;
+        Vec3 vp1 = intersection - p1;
         C = edge1.Cross(vp1);
         if (Vec3::Dot(N, C) < 0) {
             return -1;
         }
-        Vec3 edge2 = face.v0.pos - face.v2.pos;
-        Vec3 vp2 = intersection - face.v2.pos;
+        Vec3 edge2 = p0 - p2;
+        Vec3 vp2 = intersection - p2;
         C = edge2.Cross(vp2);
         if (Vec3::Dot(N, C) < 0) {
             return -1;
         }
 
-        // 4. Calculate the barycentric coordinates of the intersection point and interpolate the normal
-        float areaABC = N.Len();
-        float areaPBC = edge1.Cross(intersection - face.v1.pos).Len();
-        float areaPCA = edge2.Cross(intersection - face.v2.pos).Len();
-        float alpha = areaPBC / areaABC;
-        float beta = areaPCA / areaABC;
-        float gamma = 1.0f - alpha - beta;
+        // 4. Calculate the barycentric coordinates of the intersection point
+        Real areaABC = N.Len();
+        Real areaPBC = edge1.Cross(intersection - p1).Len();
+        Real areaPCA = edge2.Cross(intersection - p2).Len();
+        alpha = areaPBC / areaABC;
+        beta = areaPCA / areaABC;
+        return t;
+    }
+    Real IntersectTriangle(const Face& face, Vec3& interpolated_normal, Vec3& interpolated_uv) const
+    {
+        Real alpha, beta;
+        Real t = IntersectTriangle(face.v0.pos, face.v1.pos, face.v2.pos, alpha, beta);
+        if (t < 0) {
+            return -1;
+        }
+        Interpolate(face, alpha, beta, interpolated_normal, interpolated_uv);
+        return t;
+    }
+    static void Interpolate(const Face& face, Real alpha, Real beta, Vec3& interpolated_normal, Vec3& interpolated_uv)
+    {
+        Real gamma = 1 - alpha - beta;
         // interpolated_normal = (face.v0.normal * gamma) + (face.v1.normal * alpha) + (face.v2.normal * beta);
         interpolated_normal = Vec3::Normalize((face.v0.normal * alpha) + (face.v1.normal * beta) + (face.v2.normal * gamma));
-        float u = (face.v0.texture_coord.first * alpha) + (face.v1.texture_coord.first * beta) + (face.v2.texture_coord.first * gamma);
-        float v = (face.v0.texture_coord.second * alpha) + (face.v1.texture_coord.second * beta) + (face.v2.texture_coord.second * gamma);
+        Real u = (face.v0.texture_coord.first * alpha) + (face.v1.texture_coord.first * beta) + (face.v2.texture_coord.first * gamma);
+        Real v = (face.v0.texture_coord.second * alpha) + (face.v1.texture_coord.second * beta) + (face.v2.texture_coord.second * gamma);
         interpolated_uv = Vec3(u, v, 0);
         interpolated_normal.Normalize();
-        return t;
     }
     // Point IntersectionPoint(Sphere sphere, int* t)
     //     {
@@ -116,37 +201,169 @@ public:
         result.t = -1;
         if(object->type == ObjectType::SPHERE)
         {
-            auto sphere = dynamic_cast<Sphere*>(object);
+            auto sphere = static_cast<Sphere*>(object);
             result.t = IntersectSphere(*sphere);
-            //check if inside
-            if(result.t < 0)
+            if(result.t < 0 || result.t > t_max)
             {
-                result.t = IntersectSphere(*sphere);
-                if(result.t > 0)
-                {
-                    result.inside = true;
-                }
+                result.t = -1;
+                return result;
             }
+            result.inside = (origin - sphere->pos).LenSq() < sphere->radius * sphere->radius;
             auto intersect_point = at(result.t);
-           result.interpolated_normal = Vec3::Normalize(intersect_point - sphere->pos)/sphere->radius;
-           
+            result.interpolated_normal = Vec3::Normalize(intersect_point - sphere->pos)/sphere->radius;
+            // snap the hit back onto the sphere, the quadratic loses precision far from the center
+            result.geometric_normal = Vec3::Normalize(intersect_point - sphere->pos);
+            result.point = sphere->pos + result.geometric_normal * sphere->radius;
         }
         else if(object->type == ObjectType::FACE)
         {
-            auto triangle = dynamic_cast<Face*>(object);
+            if(object == origin_object)
+            {
+                return result;
+            }
+            auto triangle = static_cast<Face*>(object);
             result.t = IntersectTriangle(*triangle, result.interpolated_normal, result.interpolated_uv);
-            //check if inside
-            if(result.t < 0)
+            if(result.t < 0 || result.t > t_max)
+            {
+                result.t = -1;
+                return result;
+            }
+            // project the hit onto the triangle's plane to remove the error along the normal
+            result.geometric_normal = triangle->GetNormal();
+            auto intersect_point = at(result.t);
+            result.point = intersect_point - result.geometric_normal * Vec3::Dot(result.geometric_normal, intersect_point - triangle->v0.pos);
+        }
+        else if(object->type == ObjectType::INSTANCE)
+        {
+            auto instance = static_cast<Instance*>(object);
+            Ray local = ToLocal(*instance);
+            const MeshFile* file = instance->mesh->file.get();
+            if(!file)
             {
-                result.t = IntersectTriangle(*triangle, result.interpolated_normal, result.interpolated_uv);
-                if(result.t > 0)
+                instance->mesh->bvh.Traverse(local.origin, local.direction, local.t_min, local.t_max, [&](Object* face)
                 {
-                    result.inside = true;
+                    auto face_result = local.Intersect(face);
+                    if(face_result.t > 0 && (result.t < 0 || face_result.t < result.t))
+                    {
+                        result = face_result;
+                        result.face = static_cast<Face*>(face);
+                    }
+                    return result.t > 0 ? result.t : local.t_max;
+                });
+            }
+            else
+            {
+                // clusters are paged in only once the ray reaches their box
+                file->bvh.Traverse(local.origin, local.direction, local.t_min, local.t_max, [&](const MeshFile::Cluster* cluster)
+                {
+                    IntersectCluster(local, *file, file->Acquire(*cluster), result);
+                    return result.t > 0 ? result.t : local.t_max;
+                });
+                if(file->position_bits != 0)
+                {
+                    // quantized: positions only, the hit is decoded by Resolve
+                    return result;
                 }
             }
+            if(result.t < 0)
+            {
+                return result;
+            }
+            ToWorld(*instance, result);
         }
-
-
         return result;
     }
+    // The ray in an instance's mesh coordinates. The direction is transformed without
+    // renormalizing, so t means the same in both spaces and the closest hit in the mesh is the
+    // closest in the world.
+    Ray ToLocal(const Instance& instance) const
+    {
+        Ray local(instance.to_object.Apply(origin), instance.to_object.ApplyVector(direction));
+        local.t_min = t_min;
+        local.t_max = t_max;
+        local.origin_object = &instance == origin_object ? origin_face : nullptr;
+        return local;
+    }
+    // Closest hit of `local` (this ray from ToLocal) on the triangles of one resident cluster
+    // of `file`, taken into `result` if nearer than what it holds. The hit stays in mesh space:
+    // a quantized one at t and barycentric coordinates for Resolve, a float one for ToWorld.
+    void IntersectCluster(Ray& local, const MeshFile& file, std::shared_ptr<const MeshCluster> resident, RayResult& result) const
+    {
+        Real t_max = result.t > 0 ? result.t : local.t_max;
+        if(file.position_bits != 0)
+        {
+            bool found = false;
+            resident->compact_bvh.Traverse(local.origin, local.direction, local.t_min, t_max, [&](const CompactTriangle* triangle)
+            {
+                int i = (int)(triangle - resident->compact.data());
+                Real alpha, beta;
+                Real t = local.origin_object && resident->first + i == origin_index ? -1
+                    : local.IntersectTriangle(triangle->pos[0], triangle->pos[1], triangle->pos[2], alpha, beta);
+                if(t > 0 && t <= local.t_max && (result.t < 0 || t < result.t))
+                {
+                    result.t = t;
+                    result.triangle = i;
+                    result.alpha = alpha;
+                    result.beta = beta;
+                    found = true;
+                }
+                return result.t > 0 ? result.t : local.t_max;
+            });
+            if(found)
+            {
+                result.cluster = std::move(resident);
+            }
+            return;
+        }
+        // A reloaded cluster has new Face objects, possibly at the address the origin triangle
+        // had, so the origin triangle is known by its index here and not by pointer.
+        Ray unmarked = local;
+        unmarked.origin_object = nullptr;
+        const Face* before = result.face;
+        resident->bvh.Traverse(local.origin, local.direction, local.t_min, t_max, [&](Object* face)
+        {
+            if(local.origin_object && face->index == origin_index)
+            {
+                return result.t > 0 ? result.t : local.t_max;
+            }
+            auto face_result = unmarked.Intersect(face);
+            if(face_result.t > 0 && (result.t < 0 || face_result.t < result.t))
+            {
+                result = face_result;
+                result.face = static_cast<Face*>(face);
+            }
+            return result.t > 0 ? result.t : local.t_max;
+        });
+        if(result.face != before)
+        {
+            result.cluster = std::move(resident);
+        }
+    }
+    // Fill in a hit on a quantized mesh, which Intersect leaves at t and barycentric
+    // coordinates. Only the closest hit of a ray is resolved; shadow rays never are.
+    void Resolve(RayResult& result) const
+    {
+        if(result.t < 0 || result.triangle < 0)
+        {
+            return;
+        }
+        auto instance = static_cast<const Instance*>(result.object);
+        Ray local(instance->to_object.Apply(origin), instance->to_object.ApplyVector(direction));
+        std::shared_ptr<Face> face = result.cluster->DecodeFace(result.triangle);
+        Interpolate(*face, result.alpha, result.beta, result.interpolated_normal, result.interpolated_uv);
+        result.geometric_normal = face->GetNormal();
+        auto intersect_point = local.at(result.t);
+        result.point = intersect_point - result.geometric_normal * Vec3::Dot(result.geometric_normal, intersect_point - face->v0.pos);
+        result.face = face.get();
+        result.decoded = std::move(face);
+        result.triangle = -1;
+        ToWorld(*instance, result);
+    }
+    // move a hit on one of the instance's triangles from mesh to world space
+    static void ToWorld(const Instance& instance, RayResult& result)
+    {
+        result.geometric_normal = instance.NormalToWorld(result.geometric_normal);
+        result.interpolated_normal = result.face->has_normals ? instance.NormalToWorld(result.interpolated_normal) : result.geometric_normal;
+        result.point = instance.to_world.Apply(result.point);
+    }
 };
@@ -0,0 +1,1020 @@
+#pragma once
+#include "color.h"
+#include "image.h"
+#include "input.h"
+#include "mathUtil.h"
+#include "occluders.h"
+#include "options.h"
+#include "rays.h"
+#include "sampling.h"
+#include "stream.h"
+#include "threadpool.h"
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <utility>
+
+Real refraction_index;
+constexpr int MAX_DEPTH = 10;
+Color bkg_color(0.0f, 0.0f, 0.0f);
+
+// Objects a tile's rays hit or were shadowed by, one bit per object index, and bounds on its
+// shadow and secondary rays: boxes around their origins and directions and the longest one.
+// Recorded during a render so that a later scene edit can re-render only the tiles it
+// affects (see incremental.h).
+struct TileTouch
+{
+    std::vector<uint64_t> objects;
+    AABB origins, directions;
+    Real reach = 0;
+
+    void Reset(size_t object_count)
+    {
+        objects.assign((object_count + 63) / 64, 0);
+        origins = directions = AABB();
+        reach = 0;
+    }
+    void Touch(const Object &object)
+    {
+        objects[object.index >> 6] |= uint64_t(1) << (object.index & 63);
+    }
+    bool Touched(int index) const
+    {
+        return (objects[index >> 6] >> (index & 63)) & 1;
+    }
+    // ray segment up to t, which may be infinite
+    void Trace(const Ray &ray, Real t)
+    {
+        origins.Grow(ray.origin);
+        directions.Grow(ray.direction);
+        reach = std::max(reach, t);
+    }
+    // false only if no recorded ray can pass through `box`. Each axis bounds the t at which
+    // some origin and direction in the boxes are inside the slab; the axes are treated
+    // independently, which can only widen the answer.
+    bool MayCross(const AABB &box) const
+    {
+        if (origins.Empty())
+        {
+            return false;
+        }
+        Real lo = 0, hi = reach;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            Real o0 = (&origins.min.x)[axis], o1 = (&origins.max.x)[axis];
+            Real d0 = (&directions.min.x)[axis], d1 = (&directions.max.x)[axis];
+            Real b0 = (&box.min.x)[axis], b1 = (&box.max.x)[axis];
+            // lowest point o0 + t d0 must stay at or below b1
+            if (d0 > 0)
+            {
+                hi = std::min(hi, (b1 - o0) / d0);
+            }
+            else if (d0 < 0)
+            {
+                lo = std::max(lo, (b1 - o0) / d0);
+            }
+            else if (o0 > b1)
+            {
+                return false;
+            }
+            // highest point o1 + t d1 must reach b0
+            if (d1 < 0)
+            {
+                hi = std::min(hi, (b0 - o1) / d1);
+            }
+            else if (d1 > 0)
+            {
+                lo = std::max(lo, (b0 - o1) / d1);
+            }
+            else if (o1 < b0)
+            {
+                return false;
+            }
+        }
+        return lo <= hi;
+    }
+};
+// record of the tile the current thread is rendering, null when nothing is recorded
+thread_local TileTouch *active_touch = nullptr;
+
+// Shadow rays of one shading point, answered in batches by the wavefront renderer instead of
+// traced one at a time. While active_shadows is set, the k-th shadow ray of the point takes the
+// answer recorded for it if the recorded ray is the same; otherwise it is recorded and counted
+// as unblocked, and the point has to be shaded again once it is answered.
+struct ShadowQueries
+{
+    struct Query
+    {
+        Ray ray;
+        Real transmittance;
+    };
+    std::vector<Query> queries;
+    // queries[0, answered) hold answers
+    size_t answered = 0;
+    size_t next = 0;
+
+    Real Transmittance(const Ray &ray)
+    {
+        size_t k = next++;
+        if (k < answered && queries[k].ray.origin == ray.origin && queries[k].ray.direction == ray.direction &&
+            queries[k].ray.t_max == ray.t_max)
+        {
+            return queries[k].transmittance;
+        }
+        // an earlier answer sent the point down another path; what followed no longer applies
+        queries.resize(std::min(k, queries.size()), {ray, 1});
+        answered = std::min(answered, k);
+        queries.push_back({ray, 1});
+        return 1;
+    }
+    bool Complete() const
+    {
+        return answered == queries.size();
+    }
+};
+thread_local ShadowQueries *active_shadows = nullptr;
+// PixelKey of the pixel the current thread is shading; every stochastic choice is seeded from
+// it, so set it before tracing a pixel
+thread_local uint64_t active_pixel = 0;
+
+// CullToViews keeps every object when false, e.g. to check that culling changes no pixel
+bool cull_primary = true;
+// lights sampled per shading point, 0 evaluates every light that reaches it
+int light_samples = 0;
+// shadow rays per area light at a shading point in a penumbra; points whose first
+// kAreaFirstSamples rays agree stop there
+int area_samples = 32;
+constexpr int kAreaFirstSamples = 4;
+// points on an area light its unshadowed shading is averaged over
+constexpr int kAreaShadeSamples = 16;
+constexpr uint32_t kCenterStrata = 1u << 27; // half of 1 / kAreaShadeSamples
+
+// well mixed 32 bits from the bits of a point; a pixel shades a new point at every bounce, so
+// this goes into the sample dimension to keep the choices at each point apart
+uint32_t HashPoint(const Point &p, uint32_t salt)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ salt;
+    for (Real c : {p.x, p.y, p.z})
+    {
+        uint64_t bits = 0;
+        std::memcpy(&bits, &c, sizeof(c));
+        h = (h ^ bits) * 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+    }
+    return (uint32_t)(h >> 32);
+}
+
+// Calls shade(light, scale) for the lights that reach p, scale being the light's falloff.
+// With light_samples > 0 and more candidates than that, it instead picks light_samples
+// lights with probability proportional to an estimate of their diffuse contribution
+// (brightness * falloff * cosine) and scales each by 1 / (light_samples * probability), which
+// keeps the expected result unchanged for lights in front of the surface. Lights behind it
+// are never picked then.
+template <typename Shade>
+void ForEachLight(const InputFileData &input, const Point &p, const Vec3 &normal, Shade &&shade)
+{
+    if (light_samples <= 0)
+    {
+        input.light_grid.ForEachCandidate(p, [&](int i)
+                                          {
+            const Light &light = input.lights[i];
+            Real falloff = light.Falloff(p);
+            if (falloff > 0)
+            {
+                shade(light, falloff);
+            } });
+        return;
+    }
+    // estimates are kept per thread; shade() only casts shadow rays, so it never re-enters
+    thread_local std::vector<std::pair<int, Real>> candidates;
+    candidates.clear();
+    Real total = 0;
+    input.light_grid.ForEachCandidate(p, [&](int i)
+                                      {
+        const Light &light = input.lights[i];
+        Real falloff = light.Falloff(p);
+        if (falloff <= 0)
+        {
+            return;
+        }
+        Vec3 to_light = light.type == LightType::DIRECTIONAL ? -Vec3::Normalize(light.pos) : Vec3::Normalize(light.pos - p);
+        Real brightness = light.color.R + light.color.G + light.color.B;
+        total += brightness * falloff * std::max(Real(0), Vec3::Dot(normal, to_light));
+        candidates.push_back({i, total}); });
+    if ((int)candidates.size() <= light_samples || !(total > 0))
+    {
+        for (const auto &[i, cdf] : candidates)
+        {
+            shade(input.lights[i], input.lights[i].Falloff(p));
+        }
+        return;
+    }
+    uint32_t dimension = HashPoint(p, 0);
+    for (int k = 0; k < light_samples; k++)
+    {
+        Real u = SampleUniform(active_pixel, k, dimension) * total;
+        auto it = std::upper_bound(candidates.begin(), candidates.end(), u, [](Real value, const std::pair<int, Real> &c)
+                                   { return value < c.second; });
+        if (it == candidates.end())
+        {
+            --it;
+        }
+        Real previous = it == candidates.begin() ? 0 : (it - 1)->second;
+        Real probability = (it->second - previous) / total;
+        const Light &light = input.lights[it->first];
+        shade(light, light.Falloff(p) / (light_samples * probability));
+    }
+}
+
+Real SchlickFresnel(Real n1, Real n2, Real cosI, Real cosT)
+{
+    Real R0 = (n1 - n2) / (n1 + n2);
+    R0 *= R0;
+    Real x = 1 - (n1 > n2 ? cosI : cosT);
+    Real x2 = x * x;
+    Real x5 = x2 * x2 * x;
+    return R0 + (1 - R0) * x5;
+}
+
+// width of the ray cone where it meets a surface, stretched by the grazing angle
+Real SurfaceFootprint(const Ray &ray, Real t, const Vec3 &normal)
+{
+    Real cos_theta = std::abs(Vec3::Dot(Vec3::Normalize(ray.direction), normal));
+    return ray.FootprintAt(t) / std::max(cos_theta, Real(0.05));
+}
+
+// closest hit along the ray within (t_min, t_max], res.t < 0 if there is none
+RayResult IntersectScene(Ray &ray, const BVH &bvh)
+{
+    RayResult res;
+    res.t = -1;
+    bvh.Traverse(ray.origin, ray.direction, ray.t_min, ray.t_max, [&](Object *obj)
+                 {
+        auto temp_res = ray.Intersect(obj);
+        if (temp_res.t > 0 && (res.t < 0 || temp_res.t < res.t))
+        {
+            res = temp_res;
+            res.object = obj;
+        }
+        return res.t > 0 ? res.t : ray.t_max; });
+    ray.Resolve(res);
+    return res;
+}
+
+Color TraceRay(Ray ray, int depth, InputFileData &input);
+
+// Local illumination of a hit (ambient, lights and shadows) and the shading frame secondary
+// rays leave from.
+struct SurfaceShading
+{
+    Color local;
+    Vec3 normal;
+    Vec3 view_dir;
+};
+
+template <ObjectType Type, unsigned Features>
+SurfaceShading ShadeLocalT(const Object &object, InputFileData &input, const RayResult &ray_result,
+                           Ray &ray, const Texture *texture)
+{
+    constexpr bool textured = Features & SHADE_TEXTURED;
+    constexpr bool smooth_normals = Features & SHADE_SMOOTH_NORMALS;
+
+    const Material &material = shading_material(object);
+    Color diffuse;
+    Vec3 object_normal;
+    Vec3 view_dir = -Vec3::Normalize(ray.direction);
+
+    auto intersection_point = ray.at(ray_result.t);
+    if constexpr (Type == ObjectType::SPHERE)
+    {
+        const auto &sphere = static_cast<const Sphere &>(object);
+        object_normal = Vec3::Normalize((intersection_point - sphere.pos) / sphere.radius);
+        if constexpr (textured)
+        {
+            constexpr Real pi = Real(M_PI);
+            Real phi = std::acos(object_normal.z);
+            Real theta = std::atan2(object_normal.y, object_normal.x);
+            Real u = theta / (2 * pi) + Real(0.5);
+            Real v = phi / pi;
+            // u wraps the circumference and v spans half of it
+            Real texels_per_unit = std::max(texture->width / (2 * pi * sphere.radius), texture->height / (pi * sphere.radius));
+            Real lod = texture->LevelOfDetail(SurfaceFootprint(ray, ray_result.t, object_normal), texels_per_unit);
+            diffuse = texture->Sample(u, v, lod, true);
+        }
+    }
+    else
+    {
+        // an instance shades the triangle of its mesh that was hit, with its edges in world space
+        const auto &face = Type == ObjectType::INSTANCE ? *ray_result.face : static_cast<const Face &>(object);
+        Vec3 v1v0 = face.v1.pos - face.v0.pos;
+        Vec3 v2v0 = face.v2.pos - face.v0.pos;
+        if constexpr (Type == ObjectType::INSTANCE)
+        {
+            const auto &instance = static_cast<const Instance &>(object);
+            v1v0 = instance.to_world.ApplyVector(v1v0);
+            v2v0 = instance.to_world.ApplyVector(v2v0);
+        }
+        diffuse = material.diffuse;
+        if constexpr (!smooth_normals)
+        {
+            object_normal = Vec3::Normalize(Vec3::Cross(v1v0, v2v0));
+        }
+        else
+        {
+            object_normal = Vec3::Normalize(ray_result.interpolated_normal);
+        }
+        if constexpr (textured)
+        {
+            auto u = ray_result.interpolated_uv.x;
+            auto v = ray_result.interpolated_uv.y;
+            // ratio of the triangle's area in texels to its area in world units
+            float du1 = face.v1.texture_coord.first - face.v0.texture_coord.first;
+            float dv1 = face.v1.texture_coord.second - face.v0.texture_coord.second;
+            float du2 = face.v2.texture_coord.first - face.v0.texture_coord.first;
+            float dv2 = face.v2.texture_coord.second - face.v0.texture_coord.second;
+            float texel_area = std::abs(du1 * dv2 - du2 * dv1) * texture->width * texture->height;
+            Real world_area = Vec3::Cross(v1v0, v2v0).Len();
+            Real texels_per_unit = world_area > 0 ? std::sqrt(texel_area / world_area) : 0;
+            Real lod = texture->LevelOfDetail(SurfaceFootprint(ray, ray_result.t, object_normal), texels_per_unit);
+            diffuse = texture->Sample(u, v, lod);
+        }
+    }
+
+    Color ambient = diffuse * material.k_ambient;
+    Color diffuse_sum;
+    Color specular_sum;
+    OccluderCache &occluders = OccluderCache::Local(input);
+    ForEachLight(input, intersection_point, object_normal, [&](const Light &light, Real scale)
+                 {
+        int light_index = (int)(&light - input.lights.data());
+        // fraction of the light that gets through along light_dir, 0 in full shadow
+        auto transmittance = [&](const Vec3 &light_dir, Real distance_to_light)
+        {
+            Ray shadow_ray(ray_result, light_dir);
+            shadow_ray.t_max = distance_to_light;
+            if (active_shadows)
+            {
+                return active_shadows->Transmittance(shadow_ray);
+            }
+            if (active_touch)
+            {
+                active_touch->Trace(shadow_ray, distance_to_light);
+            }
+            Real shadow_opacity = 1;
+            // try the object that last blocked this light first, with the box test before it as
+            // in the BVH, so the cache never accepts a grazing hit the traversal would have culled;
+            // an edit may have made it translucent since it was cached
+            Object *occluder = occluders.Get(light_index);
+            bool cached = false;
+            if (occluder && shading_material(*occluder).alpha >= 1)
+            {
+                Vec3 inv_dir(1 / shadow_ray.direction.x, 1 / shadow_ray.direction.y, 1 / shadow_ray.direction.z);
+                cached = ObjectBounds(*occluder).Hit(shadow_ray.origin, inv_dir, shadow_ray.t_min, shadow_ray.t_max) &&
+                         shadow_ray.Intersect(occluder).t > 0;
+            }
+            if (cached)
+            {
+                if (active_touch)
+                {
+                    active_touch->Touch(*occluder);
+                }
+                shadow_opacity = 0;
+            }
+            else
+            {
+                input.bvh.Traverse(shadow_ray.origin, shadow_ray.direction, shadow_ray.t_min, shadow_ray.t_max, [&](Object *obj)
+                                   {
+                    Real t = shadow_ray.Intersect(obj).t;
+                    if (t > 0)
+                    {
+                        if (active_touch)
+                        {
+                            active_touch->Touch(*obj);
+                        }
+                        if (shading_material(*obj).alpha >= 1)
+                        {
+                            occluders.Set(light_index, obj);
+                        }
+                        shadow_opacity *= (1 - shading_material(*obj).alpha);
+                        if (shadow_opacity < 0.01)
+                        {
+                            return Real(-1);
+                        }
+                    }
+                    return shadow_ray.t_max; });
+            }
+            occluders.Count(cached, shadow_opacity < 1);
+            return std::clamp(shadow_opacity, Real(0), Real(1));
+        };
+        // Compute the diffuse and specular contribution from the light source
+        auto contribution = [&](const Vec3 &light_dir, Real weight, Color &diffuse_out, Color &specular_out)
+        {
+            Real diffuse_factor = std::max(Real(0), Vec3::Dot(object_normal, light_dir));
+            diffuse_out += diffuse * diffuse_factor * light.color * weight;
+
+            Vec3 half_vec = Vec3::Normalize(light_dir + view_dir);
+            Real specular_factor = std::pow(std::max(Real(0), Vec3::Dot(object_normal, half_vec)), Real(material.specular_exponent));
+            specular_out += material.specular * specular_factor * light.color * weight;
+        };
+
+        if (!light.IsArea())
+        {
+            Vec3 light_dir;
+            Real distance_to_light;
+            if (light.type == LightType::DIRECTIONAL)
+            {
+                light_dir = -Vec3::Normalize(light.pos);
+                distance_to_light = std::numeric_limits<Real>::infinity();
+            }
+            else
+            {
+                light_dir = Vec3::Normalize(light.pos - intersection_point);
+                distance_to_light = Vec3::Distance(intersection_point, light.pos);
+            }
+            contribution(light_dir, transmittance(light_dir, distance_to_light) * scale, diffuse_sum, specular_sum);
+            return;
+        }
+        // Area light: unshadowed shading averaged over a fixed set of points on the light,
+        // times the fraction of it that is visible. The shading points are the same everywhere,
+        // so fully lit surfaces come out smooth; the visibility is estimated with shadow rays
+        // along a Sobol sequence scrambled per pixel and point, weighted by the same cosine. If the
+        // first few rays agree, the point is fully lit or fully in the umbra and sampling stops;
+        // otherwise it is in a penumbra and gets area_samples rays.
+        Color area_diffuse, area_specular;
+        for (int k = 0; k < kAreaShadeSamples; k++)
+        {
+            // the XOR moves the points of the unscrambled sequence to the centers of their strata
+            Point target = light.SamplePoint(Sobol(k, 0, kCenterStrata), Sobol(k, 1, kCenterStrata), intersection_point);
+            contribution(Vec3::Normalize(target - intersection_point), Real(1) / kAreaShadeSamples, area_diffuse, area_specular);
+        }
+        if (area_diffuse.R + area_diffuse.G + area_diffuse.B + area_specular.R + area_specular.G + area_specular.B <= 0)
+        {
+            return;
+        }
+        uint32_t scramble_u = SampleBits(active_pixel, 0, HashPoint(intersection_point, 2 * light_index + 1));
+        uint32_t scramble_v = SampleBits(active_pixel, 0, HashPoint(intersection_point, 2 * light_index + 2));
+        Real lit_sum = 0, weight_sum = 0;
+        Real lit_min = 1, lit_max = 0;
+        int count = std::min(kAreaFirstSamples, area_samples);
+        for (int k = 0; k < count; k++)
+        {
+            Point target = light.SamplePoint(Sobol(k, 0, scramble_u), Sobol(k, 1, scramble_v), intersection_point);
+            Vec3 to_light = target - intersection_point;
+            Real distance_to_light = to_light.Len();
+            Vec3 light_dir = to_light / distance_to_light;
+            Real weight = Vec3::Dot(object_normal, light_dir);
+            if (weight > 0)
+            {
+                Real lit = transmittance(light_dir, distance_to_light);
+                lit_min = std::min(lit_min, lit);
+                lit_max = std::max(lit_max, lit);
+                lit_sum += lit * weight;
+                weight_sum += weight;
+            }
+            if (k + 1 == count && lit_min < lit_max)
+            {
+                count = area_samples;
+            }
+        }
+        Real visible = weight_sum > 0 ? lit_sum / weight_sum : 0;
+        diffuse_sum += area_diffuse * (visible * scale);
+        specular_sum += area_specular * (visible * scale); });
+    Color local_illumination = ambient + diffuse_sum * material.k_diffuse + specular_sum * material.k_specular;
+    return {local_illumination, object_normal, view_dir};
+}
+
+// Refraction at a hit, with the indices of refraction taken from the stack of media the ray
+// travels through. valid is false when the ray leaves a medium it never entered.
+struct Refraction
+{
+    bool valid = false;
+    bool entering = false;
+    bool total_internal = false;
+    Real fresnel = 0;
+    Vec3 direction;
+};
+
+Refraction Refract(const Vec3 &normal, const Vec3 &view_dir, const Material &material, const std::vector<Real> &ior_stack)
+{
+    Refraction r;
+    r.entering = Vec3::Dot(normal, view_dir) > 0;
+    // a ray that has left every refractive object it entered is back in the scene's medium
+    Real n1 = r.entering ? (ior_stack.empty() ? refraction_index : ior_stack.back()) : material.eta;
+    Real n2;
+    if (r.entering)
+    {
+        n2 = material.eta;
+    }
+    else
+    {
+        if (ior_stack.empty())
+        {
+            return r;
+        }
+        n2 = ior_stack.back();
+    }
+    r.valid = true;
+
+    Real n = n1 / n2;
+    Real cosI = -Vec3::Dot(normal, view_dir);
+    Real sinT2 = n * n * (1 - cosI * cosI);
+    Real cosT = std::sqrt(1 - sinT2);
+    r.fresnel = SchlickFresnel(n1, n2, cosI, cosT);
+    r.total_internal = sinT2 > 1;
+    if (!r.total_internal)
+    {
+        r.direction = Vec3::Normalize(n * view_dir + (n * cosI - cosT) * normal);
+    }
+    return r;
+}
+
+// Shader specialized on object type and material feature set (see classify_shaders). Paths a
+// feature set cannot reach are compiled out, so the common opaque untextured case is just
+// Blinn-Phong plus shadow rays.
+template <ObjectType Type, unsigned Features>
+Color ShadeRayT(const Object &object, InputFileData &input, const RayResult &ray_result,
+                Ray &ray, const Texture *texture, int depth, std::vector<Real> ior_stack)
+{
+    constexpr bool reflective = Features & SHADE_REFLECTIVE;
+    constexpr bool refractive = Features & SHADE_REFRACTIVE;
+
+    if (depth > MAX_DEPTH)
+    {
+        return bkg_color;
+    }
+    const Material &material = shading_material(object);
+    SurfaceShading surface = ShadeLocalT<Type, Features>(object, input, ray_result, ray, texture);
+    const Color &local_illumination = surface.local;
+    const Vec3 &object_normal = surface.normal;
+    if constexpr (!reflective && !refractive)
+    {
+        return local_illumination;
+    }
+
+    // Reflection and refraction
+    Real reflection_factor = material.k_specular;
+    Color reflection_color = Color(0, 0, 0);
+    Color refraction_color = Color(0, 0, 0);
+    if constexpr (reflective)
+    {
+        Vec3 reflection_dir = Vec3::Reflect(ray.direction, object_normal);
+        Ray reflection_ray(ray_result, reflection_dir);
+        reflection_ray.cone_width = ray.FootprintAt(ray_result.t);
+        reflection_ray.cone_spread = ray.cone_spread;
+        reflection_color = TraceRay(reflection_ray, depth + 1, input) * reflection_factor;
+    }
+    if constexpr (refractive)
+    {
+        Refraction refraction = Refract(object_normal, surface.view_dir, material, ior_stack);
+        if (!refraction.valid)
+        {
+            return Color(0, 0, 0);
+        }
+        Real fresnel = refraction.fresnel;
+        if (refraction.total_internal)
+        {
+            if constexpr (reflective) // Check if ks != 0
+            {
+                return reflection_color * fresnel;
+            }
+        }
+        else
+        {
+            Ray refraction_ray(ray_result, refraction.direction);
+            refraction_ray.cone_width = ray.FootprintAt(ray_result.t);
+            refraction_ray.cone_spread = ray.cone_spread;
+
+            // Update the ior_stack based on whether the ray is entering or exiting the object
+            if (refraction.entering)
+            {
+                ior_stack.push_back(material.eta);
+            }
+            else
+            {
+                ior_stack.pop_back();
+            }
+
+            // Trace the refracted ray, the material is not fully opaque
+            refraction_color = ShadeRayT<Type, Features>(object, input, ray_result, refraction_ray, texture, depth + 1, std::move(ior_stack)) * fresnel;
+        }
+        reflection_color = reflection_color * fresnel;
+        refraction_color = refraction_color * (1 - fresnel);
+    }
+
+    return local_illumination + reflection_color + refraction_color;
+}
+
+using ShadeFunction = Color (*)(const Object &, InputFileData &, const RayResult &, Ray &, const Texture *, int, std::vector<Real>);
+
+template <ObjectType Type, unsigned... Features>
+constexpr std::array<ShadeFunction, SHADE_FEATURE_COUNT> MakeShaderTable(std::integer_sequence<unsigned, Features...>)
+{
+    return {&ShadeRayT<Type, Features>...};
+}
+
+// one instantiation per object type and feature set, indexed by Object::shader_features
+constexpr auto kSphereShaders = MakeShaderTable<ObjectType::SPHERE>(std::make_integer_sequence<unsigned, SHADE_FEATURE_COUNT>());
+constexpr auto kFaceShaders = MakeShaderTable<ObjectType::FACE>(std::make_integer_sequence<unsigned, SHADE_FEATURE_COUNT>());
+constexpr auto kInstanceShaders = MakeShaderTable<ObjectType::INSTANCE>(std::make_integer_sequence<unsigned, SHADE_FEATURE_COUNT>());
+
+Color ShadeRay(const Object &object, InputFileData &input, const RayResult &ray_result,
+               Ray &ray, const Texture *texture = nullptr, int depth = 0, std::vector<Real> ior_stack = {1.0})
+{
+    const auto &table = object.type == ObjectType::SPHERE ? kSphereShaders
+                        : object.type == ObjectType::FACE ? kFaceShaders
+                                                            : kInstanceShaders;
+    return table[object.shader_features](object, input, ray_result, ray, texture, depth, std::move(ior_stack));
+}
+
+// index of refraction stack a ray arriving from the camera side starts with; only refractive
+// shaders read it
+std::vector<Real> InitialIorStack(const Object &object, const InputFileData &input)
+{
+    std::vector<Real> ior_stack;
+    if (object.shader_features & SHADE_REFRACTIVE)
+    {
+        ior_stack = {input.index_of_refraction};
+    }
+    return ior_stack;
+}
+
+// shade a hit found by IntersectScene (or read back from a G-buffer)
+Color ShadeHit(Ray &ray, const RayResult &hit, int depth, InputFileData &input)
+{
+    Object *obj = hit.object;
+
+    // holds the texture resident while this hit is shaded, even if the cache evicts it
+    std::shared_ptr<const Texture> texture;
+    if (obj->texture_index != -1)
+    {
+        texture = TextureCache::Global().Acquire(input.texture[obj->texture_index]);
+    }
+    auto color = ShadeRay(*obj, input, hit, ray, texture.get(), depth, InitialIorStack(*obj, input));
+    return color;
+}
+
+// BVH rays of this depth are traced against: primary rays only see what CullToView kept,
+// secondary and shadow rays the whole scene
+const BVH &SceneBVH(const InputFileData &input, int depth)
+{
+    return depth == 1 && input.primary_culled ? input.primary_bvh : input.bvh;
+}
+
+Color TraceRay(Ray ray, int depth, InputFileData &input)
+{
+    if (depth >= MAX_DEPTH)
+    {
+        return input.bkgcolor;
+    }
+
+    auto hit = IntersectScene(ray, SceneBVH(input, depth));
+    // primary rays are covered by projecting edits onto the image instead
+    if (active_touch && depth > 1)
+    {
+        active_touch->Trace(ray, hit.t < 0 ? INFINITY : hit.t);
+    }
+    if (hit.t < 0)
+    {
+        return input.bkgcolor;
+    }
+    if (active_touch)
+    {
+        active_touch->Touch(*hit.object);
+    }
+    return ShadeHit(ray, hit, depth, input);
+}
+
+// Pinhole camera. Pixel (i, j) of the output image maps onto the image plane exactly as the
+// original single-pass renderer did, so partial renders line up with full ones.
+struct Camera
+{
+    Camera(Point eye, Vec3 viewdir, Vec3 updir, Real hfov, int image_width, int image_height)
+        : eye(eye), image_width(image_width), image_height(image_height)
+    {
+        Vec3 u = Vec3::Normalize(updir.Cross(viewdir));
+        v = Vec3::Normalize(u.Cross(viewdir));
+        Real aspect = (Real)image_width / (Real)image_height;
+        width = 2 * std::tan(hfov / 2 * Real(M_PI / 180));
+        height = width / aspect;
+        const Real d = 1;
+        Point ul = eye + (Vec3::Normalize(viewdir) * d) - (u * (width / 2)) + (v * (height / 2));
+        Point ur = eye + (Vec3::Normalize(viewdir) * d) + (u * (width / 2)) + (v * (height / 2));
+        lr = eye + (Vec3::Normalize(viewdir) * d) + (u * (width / 2)) - (v * (height / 2));
+        delta_h = (ur - ul) / ((Real)image_width);
+        // one pixel on the image plane at distance d
+        spread = width / (Real)image_width / d;
+    }
+    static Camera FromScene(const InputFileData &input)
+    {
+        return Camera(input.eye, input.viewdir, input.updir, input.hfov, input.imsize.first, input.imsize.second);
+    }
+    // image position (i, j) of world point p, false if p is not in front of the camera
+    bool Project(const Point &p, Real &i, Real &j) const
+    {
+        Vec3 forward = lr - delta_h * ((Real)image_width / 2) + v * (height / 2) - eye;
+        Real depth = Vec3::Dot(p - eye, forward);
+        if (!(depth > 0))
+        {
+            return false;
+        }
+        Point q = eye + (p - eye) * (Vec3::Dot(forward, forward) / depth);
+        i = Vec3::Dot(lr - q, delta_h) / Vec3::Dot(delta_h, delta_h);
+        j = Vec3::Dot(q - lr, v) / height * (Real)image_height;
+        return true;
+    }
+    Ray PrimaryRay(int i, int j) const
+    {
+        Point p = lr - (delta_h * (Real)i) + (v * height * ((Real)j / (Real)image_height));
+        Ray ray = Ray(eye, Vec3::Normalize(p - eye));
+        ray.cone_spread = spread;
+        return ray;
+    }
+    Point eye;
+    Vec3 v, delta_h;
+    Point lr;
+    Real width, height, spread;
+    int image_width, image_height;
+};
+
+// half-open pixel rectangle [x0, x1) x [y0, y1)
+struct Region
+{
+    int x0, y0, x1, y1;
+    int Width() const
+    {
+        return x1 - x0;
+    }
+    int Height() const
+    {
+        return y1 - y0;
+    }
+};
+
+struct View
+{
+    Camera camera;
+    Region region;
+};
+
+// camera and pixel region for the scene with `view` applied, nothing if the result is not
+// a valid, non-empty part of the image
+std::optional<View> ResolveView(const InputFileData &input, const ViewOverride &view)
+{
+    auto vec = [](const double *v)
+    { return Vec3((Real)v[0], (Real)v[1], (Real)v[2]); };
+    Point eye = view.fields & VIEW_EYE ? vec(view.eye) : input.eye;
+    Vec3 viewdir = view.fields & VIEW_VIEWDIR ? vec(view.viewdir) : input.viewdir;
+    Vec3 updir = view.fields & VIEW_UPDIR ? vec(view.updir) : input.updir;
+    Real hfov = view.fields & VIEW_HFOV ? (Real)view.hfov : input.hfov;
+    int width = view.fields & VIEW_IMSIZE ? view.imsize[0] : input.imsize.first;
+    int height = view.fields & VIEW_IMSIZE ? view.imsize[1] : input.imsize.second;
+    Region region = {0, 0, width, height};
+    if (view.fields & VIEW_REGION)
+    {
+        region = {view.region[0], view.region[1], view.region[2], view.region[3]};
+    }
+    if (width <= 0 || height <= 0 || region.x0 < 0 || region.y0 < 0 || region.x1 > width ||
+        region.y1 > height || region.Width() <= 0 || region.Height() <= 0)
+    {
+        return std::nullopt;
+    }
+    return View{Camera(eye, viewdir, updir, hfov, width, height), region};
+}
+
+// view of a scene camera; what `view` sets (e.g. --imsize, --region) applies on top
+std::optional<View> ResolveCamera(const InputFileData &input, const SceneCamera &camera, const ViewOverride &view)
+{
+    ViewOverride merged = camera.view;
+    auto copy = [&](ViewField field, const double *from, double *to)
+    {
+        if (view.fields & field)
+        {
+            std::copy(from, from + 3, to);
+        }
+    };
+    copy(VIEW_EYE, view.eye, merged.eye);
+    copy(VIEW_VIEWDIR, view.viewdir, merged.viewdir);
+    copy(VIEW_UPDIR, view.updir, merged.updir);
+    if (view.fields & VIEW_HFOV)
+    {
+        merged.hfov = view.hfov;
+    }
+    if (view.fields & VIEW_IMSIZE)
+    {
+        std::copy(view.imsize, view.imsize + 2, merged.imsize);
+    }
+    if (view.fields & VIEW_REGION)
+    {
+        std::copy(view.region, view.region + 4, merged.region);
+    }
+    merged.fields |= view.fields;
+    if (camera.shift != 0)
+    {
+        auto vec = [](const double *v)
+        { return Vec3((Real)v[0], (Real)v[1], (Real)v[2]); };
+        Point eye = merged.fields & VIEW_EYE ? vec(merged.eye) : input.eye;
+        Vec3 viewdir = merged.fields & VIEW_VIEWDIR ? vec(merged.viewdir) : input.viewdir;
+        Vec3 updir = merged.fields & VIEW_UPDIR ? vec(merged.updir) : input.updir;
+        eye = eye + Vec3::Normalize(viewdir.Cross(updir)) * camera.shift;
+        merged.eye[0] = eye.x;
+        merged.eye[1] = eye.y;
+        merged.eye[2] = eye.z;
+        merged.fields |= VIEW_EYE;
+    }
+    return ResolveView(input, merged);
+}
+
+// Prepass for one render: keep the objects whose bounds reach into the frustum of a view's
+// region, i.e. the four planes through the eye and the region's corner pixels (widened by half
+// a pixel) and the plane through the eye facing along the view, and build primary_bvh over
+// them. A box is dropped only if it lies entirely outside one plane, so no primary ray can
+// miss an object it would have hit. With several views an object is kept if any of them can
+// see it. If everything is visible primary rays keep using bvh. Animation frames and server
+// edits mostly keep the same objects in view, so the tree is only rebuilt when the set
+// changes; otherwise the objects may have moved and a refit updates its bounds.
+void CullToViews(InputFileData &input, const std::vector<View> &views)
+{
+    struct Frustum
+    {
+        Point eye;
+        // inward normals: a point p can be seen only if Dot(normal, p - eye) >= 0 for all five
+        Vec3 normals[5];
+    };
+    std::vector<Frustum> frustums;
+    for (const View &view : views)
+    {
+        const Camera &camera = view.camera;
+        const Region &region = view.region;
+        auto corner = [&](Real i, Real j)
+        { return camera.lr - (camera.delta_h * i) + (camera.v * camera.height * (j / (Real)camera.image_height)) - camera.eye; };
+        Vec3 d[4] = {corner(region.x0 - Real(0.5), region.y0 - Real(0.5)), corner(region.x1 - Real(0.5), region.y0 - Real(0.5)),
+                     corner(region.x1 - Real(0.5), region.y1 - Real(0.5)), corner(region.x0 - Real(0.5), region.y1 - Real(0.5))};
+        Vec3 center = (d[0] + d[1] + d[2] + d[3]) * Real(0.25);
+        Frustum frustum;
+        frustum.eye = camera.eye;
+        for (int k = 0; k < 4; k++)
+        {
+            frustum.normals[k] = d[k].Cross(d[(k + 1) % 4]);
+            if (Vec3::Dot(frustum.normals[k], center) < 0)
+            {
+                frustum.normals[k] = frustum.normals[k] * Real(-1);
+            }
+        }
+        frustum.normals[4] = center;
+        frustums.push_back(frustum);
+    }
+    std::vector<Object *> visible;
+    for (const auto &object : input.objects)
+    {
+        if (!cull_primary)
+        {
+            visible.push_back(object.get());
+            continue;
+        }
+        AABB box = ObjectBounds(*object);
+        for (const Frustum &frustum : frustums)
+        {
+            bool inside = true;
+            for (const Vec3 &n : frustum.normals)
+            {
+                // the box corner furthest along n
+                Point p(n.x >= 0 ? box.max.x : box.min.x, n.y >= 0 ? box.max.y : box.min.y, n.z >= 0 ? box.max.z : box.min.z);
+                if (Vec3::Dot(n, p - frustum.eye) < 0)
+                {
+                    inside = false;
+                    break;
+                }
+            }
+            if (inside)
+            {
+                visible.push_back(object.get());
+                break;
+            }
+        }
+    }
+    input.primary_objects = visible.size();
+    input.primary_culled = visible.size() < input.objects.size();
+    if (!input.primary_culled)
+    {
+        visible.clear();
+    }
+    if (visible == input.primary_visible)
+    {
+        if (input.primary_culled)
+        {
+            input.primary_bvh.Refit();
+            input.primary_refits++;
+        }
+        return;
+    }
+    input.primary_bvh.Build(visible);
+    input.primary_visible = std::move(visible);
+    input.primary_builds++;
+}
+
+void CullToView(InputFileData &input, const Camera &camera, const Region &region)
+{
+    CullToViews(input, {View{camera, region}});
+}
+
+void PrintCullStats(std::ostream &os, const InputFileData &input)
+{
+    os << "culling: primary rays see " << input.primary_objects << " of " << input.objects.size() << " objects, "
+       << input.primary_builds << " BVH builds, " << input.primary_refits << " refits" << std::endl;
+}
+
+constexpr int kTileSize = 16;
+
+// pixels [x0, x1) x [y0, y1) of the camera's image into `image`, which holds `region`
+void RenderTile(InputFileData &input, const Camera &camera, const Region &region, Image &image, int x0, int y0, int x1,
+                int y1)
+{
+    for (int j = y0; j < y1; j++)
+    {
+        for (int i = x0; i < x1; i++)
+        {
+            active_pixel = PixelKey(i, j);
+            auto color = TraceRay(camera.PrimaryRay(i, j), 1, input);
+            image.setPixel(i - region.x0, j - region.y0, color);
+        }
+    }
+    TextureCache::Global().Unpin();
+}
+
+// Render `region` of the camera's image into `image`, which must be region sized; pixel (i, j)
+// lands at (i - x0, j - y0). Work is split into kTileSize tiles, numbered row by row across the
+// region, and handed out by the pool. With `tiles` only those are rendered; with `touches`
+// (one entry per tile) each rendered tile's record is rebuilt. With `stream` every tile is sent
+// on as soon as it is done.
+void RenderRegion(InputFileData &input, const Camera &camera, const Region &region, Image &image, ThreadPool &pool,
+                  std::vector<TileTouch> *touches = nullptr, const std::vector<int> *tiles = nullptr,
+                  TileStream *stream = nullptr)
+{
+    int tiles_x = (region.Width() + kTileSize - 1) / kTileSize;
+    int tiles_y = (region.Height() + kTileSize - 1) / kTileSize;
+    int count = tiles ? (int)tiles->size() : tiles_x * tiles_y;
+    CullToView(input, camera, region);
+    pool.ParallelFor(count, [&](int n)
+                     {
+        int tile = tiles ? (*tiles)[n] : n;
+        int tx0 = region.x0 + (tile % tiles_x) * kTileSize;
+        int ty0 = region.y0 + (tile / tiles_x) * kTileSize;
+        int tx1 = std::min(tx0 + kTileSize, region.x1);
+        int ty1 = std::min(ty0 + kTileSize, region.y1);
+        if (touches)
+        {
+            (*touches)[tile].Reset(input.objects.size());
+            active_touch = &(*touches)[tile];
+        }
+        RenderTile(input, camera, region, image, tx0, ty0, tx1, ty1);
+        if (stream)
+        {
+            stream->Emit(image, tx0, ty0, tx1, ty1);
+        }
+        active_touch = nullptr; });
+}
+
+// Render several views in one pass, e.g. the cameras of a scene: one culling prepass for all
+// of them, then the tiles of every view interleaved round robin through a single
+// ParallelFor, so no view waits for another to finish and small views fill in the gaps.
+// images[k] must be sized to views[k].region.
+void RenderViews(InputFileData &input, const std::vector<View> &views, std::vector<Image> &images, ThreadPool &pool)
+{
+    struct Tile
+    {
+        int view, x0, y0, x1, y1;
+    };
+    std::vector<std::vector<Tile>> per_view(views.size());
+    size_t most = 0;
+    for (size_t k = 0; k < views.size(); k++)
+    {
+        const Region &region = views[k].region;
+        for (int ty0 = region.y0; ty0 < region.y1; ty0 += kTileSize)
+        {
+            for (int tx0 = region.x0; tx0 < region.x1; tx0 += kTileSize)
+            {
+                per_view[k].push_back({(int)k, tx0, ty0, std::min(tx0 + kTileSize, region.x1), std::min(ty0 + kTileSize, region.y1)});
+            }
+        }
+        most = std::max(most, per_view[k].size());
+    }
+    std::vector<Tile> tiles;
+    for (size_t n = 0; n < most; n++)
+    {
+        for (const auto &view_tiles : per_view)
+        {
+            if (n < view_tiles.size())
+            {
+                tiles.push_back(view_tiles[n]);
+            }
+        }
+    }
+    CullToViews(input, views);
+    pool.ParallelFor((int)tiles.size(), [&](int n)
+                     {
+        const Tile &tile = tiles[n];
+        const View &view = views[tile.view];
+        RenderTile(input, view.camera, view.region, images[tile.view], tile.x0, tile.y0, tile.x1, tile.y1); });
+}
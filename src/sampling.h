@@ -0,0 +1,67 @@
+#pragma once
+#include "mathUtil.h"
+#include <cstdint>
+
+// First two dimensions of the Sobol sequence. Every power-of-two prefix puts one point in each
+// cell of any 2^a x 2^b grid of that size, so stopping after 4, 8, 16, ... samples still
+// leaves them stratified. XOR-ing a per-point scramble into the bits (a random digital shift)
+// decorrelates neighbouring pixels and keeps that property.
+inline uint32_t SobolBits(uint32_t index, int dimension)
+{
+    if (dimension == 0)
+    {
+        // van der Corput: the index bits reversed
+        index = (index << 16) | (index >> 16);
+        index = ((index & 0x00FF00FFu) << 8) | ((index & 0xFF00FF00u) >> 8);
+        index = ((index & 0x0F0F0F0Fu) << 4) | ((index & 0xF0F0F0F0u) >> 4);
+        index = ((index & 0x33333333u) << 2) | ((index & 0xCCCCCCCCu) >> 2);
+        index = ((index & 0x55555555u) << 1) | ((index & 0xAAAAAAAAu) >> 1);
+        return index;
+    }
+    uint32_t bits = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+        {
+            bits ^= v;
+        }
+    }
+    return bits;
+}
+
+// sample `index` of the scrambled sequence in [0, 1)
+inline Real Sobol(uint32_t index, int dimension, uint32_t scramble)
+{
+    return (Real)(((SobolBits(index, dimension) ^ scramble) >> 8) * (1.0 / 16777216.0));
+}
+
+// Counter-based random bits: a value is a pure function of the pixel it belongs to, a sample
+// index and a dimension (the decision it drives), hashed with the splitmix64 finalizer. Nothing
+// is carried from one call to the next, so a pixel gets the same samples whichever thread
+// renders it and in whatever order its tiles are handed out.
+inline uint64_t MixBits(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBull;
+    h ^= h >> 31;
+    return h;
+}
+
+// seed of pixel (x, y) of the full image
+inline uint64_t PixelKey(int x, int y)
+{
+    return MixBits(((uint64_t)(uint32_t)y << 32) | (uint32_t)x);
+}
+
+inline uint32_t SampleBits(uint64_t pixel, uint32_t sample, uint32_t dimension)
+{
+    return (uint32_t)(MixBits(pixel ^ MixBits(((uint64_t)dimension << 32) | sample)) >> 32);
+}
+
+// SampleBits as a number in [0, 1)
+inline Real SampleUniform(uint64_t pixel, uint32_t sample, uint32_t dimension)
+{
+    return (Real)((SampleBits(pixel, sample, dimension) >> 8) * (1.0 / 16777216.0));
+}
@@ -0,0 +1,233 @@
+#pragma once
+#include "image.h"
+#include "incremental.h"
+#include "input.h"
+#include "options.h"
+#include "render.h"
+#include "threadpool.h"
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Render server protocol over a Unix stream socket. Both ends are this binary on the same host,
+// so structs travel in native layout. A connection carries any number of requests:
+//   request:  RenderRequest
+//   response: RenderResponse, then width * height * 3 bytes of 8-bit RGB rows when status is 0
+// An edit in the request changes the server's scene for all later requests. When the view
+// is the same as the previous request's, only the tiles the edit affects are re-rendered.
+constexpr uint32_t kRequestMagic = 0x51525452;  // "RTRQ"
+constexpr uint32_t kResponseMagic = 0x53525452; // "RTRS"
+
+struct RenderRequest
+{
+    uint32_t magic;
+    ViewOverride view;
+    SceneEdit edit;
+};
+
+enum ResponseStatus : int32_t
+{
+    RESPONSE_OK = 0,
+    RESPONSE_BAD_VIEW = 1,
+    RESPONSE_BAD_EDIT = 2
+};
+
+struct RenderResponse
+{
+    uint32_t magic;
+    int32_t status;
+    int32_t x0, y0, width, height;
+};
+
+static bool read_full(int fd, void *buffer, size_t size)
+{
+    char *p = static_cast<char *>(buffer);
+    while (size > 0)
+    {
+        ssize_t n = ::read(fd, p, size);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buffer, size_t size)
+{
+    const char *p = static_cast<const char *>(buffer);
+    while (size > 0)
+    {
+        // MSG_NOSIGNAL: a client that went away must not kill the server with SIGPIPE
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static sockaddr_un socket_address(const std::string &path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        exit(1);
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+static volatile std::sig_atomic_t server_stop = 0;
+
+static void handle_server_signal(int)
+{
+    server_stop = 1;
+}
+
+// answer requests from one client until it disconnects
+static void serve_connection(int fd, InputFileData &input, ThreadPool &pool, RenderSession &session)
+{
+    RenderRequest request;
+    while (!server_stop && read_full(fd, &request, sizeof(request)))
+    {
+        if (request.magic != kRequestMagic)
+        {
+            std::cerr << "Bad request, closing connection" << std::endl;
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        RenderResponse response = {kResponseMagic, RESPONSE_OK, 0, 0, 0, 0};
+        auto view = ResolveView(input, request.view);
+        if (!view || !ApplyEdit(input, request.edit))
+        {
+            response.status = view ? RESPONSE_BAD_EDIT : RESPONSE_BAD_VIEW;
+            if (!write_full(fd, &response, sizeof(response)))
+            {
+                return;
+            }
+            continue;
+        }
+        int tiles = session.Render(input, *view, request.edit, pool);
+        const Image &image = session.Frame();
+        std::vector<uint8_t> bytes = image.toRGB8(&pool);
+        response.x0 = view->region.x0;
+        response.y0 = view->region.y0;
+        response.width = image.width;
+        response.height = image.height;
+        if (!write_full(fd, &response, sizeof(response)) || !write_full(fd, bytes.data(), bytes.size()))
+        {
+            return;
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "rendered " << image.width << "x" << image.height << " at " << response.x0 << "," << response.y0
+                  << " in " << ms << " ms (" << tiles << " tiles)" << std::endl;
+    }
+}
+
+// Keep the parsed scene, texture cache and thread pool warm and render whatever the clients
+// ask for. Returns on SIGINT/SIGTERM.
+int RunServer(const std::string &path, InputFileData &input, ThreadPool &pool)
+{
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        std::cerr << "Failed to create socket" << std::endl;
+        return 1;
+    }
+    sockaddr_un addr = socket_address(path);
+    ::unlink(path.c_str());
+    if (::bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(listener, 8) < 0)
+    {
+        std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno) << std::endl;
+        ::close(listener);
+        return 1;
+    }
+    // no SA_RESTART, so a signal breaks accept() out of its wait
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_server_signal;
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+
+    std::cout << "Serving " << input.objects.size() << " objects on " << path << " with " << pool.Size()
+              << " threads" << std::endl;
+    RenderSession session;
+    while (!server_stop)
+    {
+        int fd = ::accept(listener, nullptr, nullptr);
+        if (fd < 0)
+        {
+            continue;
+        }
+        serve_connection(fd, input, pool, session);
+        ::close(fd);
+    }
+    ::close(listener);
+    ::unlink(path.c_str());
+    std::cout << "Server stopped" << std::endl;
+    return 0;
+}
+
+// Send one request built from the command line view options and save the answer as a PPM.
+int RunClient(const RenderOptions &options)
+{
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = socket_address(options.client_socket);
+    if (fd < 0 || ::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        std::cerr << "Failed to connect to " << options.client_socket << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    RenderRequest request = {kRequestMagic, options.view, options.edit};
+    RenderResponse response;
+    if (!write_full(fd, &request, sizeof(request)) || !read_full(fd, &response, sizeof(response)) ||
+        response.magic != kResponseMagic)
+    {
+        std::cerr << "Lost connection to server" << std::endl;
+        ::close(fd);
+        return 1;
+    }
+    if (response.status != RESPONSE_OK)
+    {
+        std::cerr << "Server rejected the " << (response.status == RESPONSE_BAD_EDIT ? "edit" : "view") << " (status "
+                  << response.status << ")" << std::endl;
+        ::close(fd);
+        return 1;
+    }
+    std::vector<uint8_t> bytes((size_t)response.width * response.height * 3);
+    if (!read_full(fd, bytes.data(), bytes.size()))
+    {
+        std::cerr << "Lost connection to server" << std::endl;
+        ::close(fd);
+        return 1;
+    }
+    ::close(fd);
+    std::string name = options.output_file.empty() ? "client.ppm" : options.output_file;
+    Image::SaveRGB8(name, response.width, response.height, bytes);
+    std::cout << "Image saved to " << name << std::endl;
+    return 0;
+}
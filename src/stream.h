@@ -0,0 +1,188 @@
+#pragma once
+#include "image.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Streaming a frame tile by tile while it renders:
+//   raytracer scene.txt --stream PATH               write records to PATH (a file or FIFO), - for stdout
+//   raytracer --reassemble PATH [-o out.ppm]        read a stream back into an image, - for stdin
+// A stream is one StreamHeader, then a TileRecord and width * height * 3 bytes of 8-bit RGB
+// (converted by ToneMap, like the PPM) per tile in the order tiles finish, then a TileRecord
+// with zero width and height. Coordinates are in the full image; a render of a region only
+// sends tiles inside it. Integers are native (little-endian) byte order.
+struct StreamHeader
+{
+    uint32_t magic;
+    int32_t width, height;
+    int32_t x0, y0, x1, y1;
+};
+
+struct TileRecord
+{
+    uint32_t magic;
+    int32_t x, y, width, height;
+};
+
+class TileStream
+{
+public:
+    static constexpr uint32_t kHeaderMagic = 0x31535452; // "RTS1"
+    static constexpr uint32_t kTileMagic = 0x454c4954;   // "TILE"
+
+    // start a stream of the region (x0, y0) - (x1, y1) of a width x height image; "-" is
+    // stdout, and a FIFO blocks here until a reader opens it
+    bool Open(const std::string &path, int width, int height, int x0, int y0, int x1, int y1)
+    {
+        // a reader that went away must fail write() with EPIPE instead of killing the renderer
+        std::signal(SIGPIPE, SIG_IGN);
+        fd = path == "-" ? STDOUT_FILENO : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to open " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        StreamHeader header = {kHeaderMagic, width, height, x0, y0, x1, y1};
+        return write(&header, sizeof(header));
+    }
+    // tile [x0, x1) x [y0, y1) of `image`, whose pixel (0, 0) is at image.origin_x,
+    // image.origin_y; called from pool threads
+    void Emit(const Image &image, int x0, int y0, int x1, int y1)
+    {
+        TileRecord record = {kTileMagic, x0, y0, x1 - x0, y1 - y0};
+        std::vector<uint8_t> bytes(sizeof(record) + (size_t)record.width * record.height * 3);
+        std::memcpy(bytes.data(), &record, sizeof(record));
+        for (int y = y0; y < y1; y++)
+        {
+            ToneMap::Output().ConvertRow(image.Row(y - image.origin_y) + (x0 - image.origin_x), record.width, x0, y,
+                                         &bytes[sizeof(record) + (size_t)(y - y0) * record.width * 3]);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        write(bytes.data(), bytes.size());
+    }
+    bool Close()
+    {
+        TileRecord end = {kTileMagic, 0, 0, 0, 0};
+        bool ok = write(&end, sizeof(end));
+        if (fd != STDOUT_FILENO)
+        {
+            ::close(fd);
+        }
+        return ok && !failed;
+    }
+
+private:
+    // after the first failure (e.g. the reader went away) the rest of the frame is dropped
+    bool write(const void *buffer, size_t size)
+    {
+        const char *p = static_cast<const char *>(buffer);
+        while (!failed && size > 0)
+        {
+            ssize_t n = ::write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                std::cerr << "Tile stream closed: " << std::strerror(errno) << std::endl;
+                failed = true;
+                break;
+            }
+            p += n;
+            size -= n;
+        }
+        return !failed;
+    }
+    int fd = -1;
+    bool failed = false;
+    std::mutex mutex;
+};
+
+static bool read_stream(int fd, void *buffer, size_t size)
+{
+    char *p = static_cast<char *>(buffer);
+    while (size > 0)
+    {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Reference reader: collect the tiles of one streamed frame and save the rendered region.
+// Pixels no tile covered stay black.
+int ReassembleStream(const std::string &path, const std::string &output)
+{
+    int fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open " << path << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    StreamHeader header;
+    if (!read_stream(fd, &header, sizeof(header)) || header.magic != TileStream::kHeaderMagic ||
+        header.x1 <= header.x0 || header.y1 <= header.y0)
+    {
+        std::cerr << "Invalid tile stream " << path << std::endl;
+        return 1;
+    }
+    int width = header.x1 - header.x0, height = header.y1 - header.y0;
+    std::vector<uint8_t> frame((size_t)width * height * 3, 0);
+    int tiles = 0;
+    while (true)
+    {
+        TileRecord record;
+        if (!read_stream(fd, &record, sizeof(record)) || record.magic != TileStream::kTileMagic)
+        {
+            std::cerr << "Tile stream " << path << " ended after " << tiles << " tiles" << std::endl;
+            return 1;
+        }
+        if (record.width == 0 && record.height == 0)
+        {
+            break;
+        }
+        if (record.width < 0 || record.height < 0 || record.x < header.x0 || record.y < header.y0 ||
+            record.x + record.width > header.x1 || record.y + record.height > header.y1)
+        {
+            std::cerr << "Tile at " << record.x << "," << record.y << " is outside the streamed region" << std::endl;
+            return 1;
+        }
+        std::vector<uint8_t> bytes((size_t)record.width * record.height * 3);
+        if (!read_stream(fd, bytes.data(), bytes.size()))
+        {
+            std::cerr << "Truncated tile in " << path << std::endl;
+            return 1;
+        }
+        for (int y = 0; y < record.height; y++)
+        {
+            std::memcpy(&frame[((size_t)(record.y - header.y0 + y) * width + (record.x - header.x0)) * 3],
+                        &bytes[(size_t)y * record.width * 3], (size_t)record.width * 3);
+        }
+        tiles++;
+    }
+    if (fd != STDIN_FILENO)
+    {
+        ::close(fd);
+    }
+    Image::SaveRGB8(output, width, height, frame);
+    std::cout << "Reassembled " << tiles << " tiles into " << output << std::endl;
+    return 0;
+}
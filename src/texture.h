@@ -0,0 +1,392 @@
+#pragma once
+#include "image.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// 8-bit texel padded to 4 bytes, so a texel never straddles a cache line
+struct Texel
+{
+    uint8_t r, g, b, a;
+};
+
+// One level of the mip pyramid. Texels are stored in 8x8 tiles (256 bytes, four cache
+// lines) and in Morton order inside each tile, so the 2x2 footprint of a bilinear lookup
+// almost always lands in the same tile.
+class MipLevel
+{
+public:
+    static constexpr int kTileShift = 3;
+    static constexpr int kTileSize = 1 << kTileShift;
+    static constexpr int kTileMask = kTileSize - 1;
+
+    MipLevel() : width(0), height(0), tiles_x(0) {}
+    MipLevel(int width, int height) : width(width), height(height)
+    {
+        tiles_x = (width + kTileMask) >> kTileShift;
+        int tiles_y = (height + kTileMask) >> kTileShift;
+        texels.resize(tiles_x * tiles_y * kTileSize * kTileSize);
+    }
+    void setTexel(int x, int y, const Texel &t)
+    {
+        texels[index(x, y)] = t;
+    }
+    const Texel &fetch(int x, int y) const
+    {
+        return texels[index(x, y)];
+    }
+    size_t bytes() const
+    {
+        return texels.size() * sizeof(Texel);
+    }
+    int width, height;
+
+private:
+    // interleave the low 3 bits of x and y
+    static int morton(int x, int y)
+    {
+        int m = 0;
+        for (int i = 0; i < kTileShift; i++)
+        {
+            m |= ((x >> i) & 1) << (2 * i);
+            m |= ((y >> i) & 1) << (2 * i + 1);
+        }
+        return m;
+    }
+    int index(int x, int y) const
+    {
+        int tile = (y >> kTileShift) * tiles_x + (x >> kTileShift);
+        return (tile << (2 * kTileShift)) | morton(x & kTileMask, y & kTileMask);
+    }
+    int tiles_x;
+    std::vector<Texel> texels;
+};
+
+// Texture converted at load time into a tiled 8-bit mip pyramid. Sampling is trilinear,
+// with the level picked by the caller from the ray footprint (see LevelOfDetail).
+class Texture
+{
+public:
+    Texture() : width(0), height(0) {}
+    explicit Texture(const Image &image) : width(image.width), height(image.height), name(image.name)
+    {
+        // box filter in float so quantization error does not build up down the pyramid
+        std::vector<Color> current(width * height);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                current[y * width + x] = image.getPixel(x, y);
+            }
+        }
+        int w = width, h = height;
+        while (true)
+        {
+            levels.push_back(quantize(current, w, h));
+            if (w == 1 && h == 1)
+            {
+                break;
+            }
+            int nw = std::max(1, w / 2), nh = std::max(1, h / 2);
+            std::vector<Color> next(nw * nh);
+            for (int y = 0; y < nh; y++)
+            {
+                for (int x = 0; x < nw; x++)
+                {
+                    int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                    int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                    next[y * nw + x] = (current[y0 * w + x0] + current[y0 * w + x1] +
+                                        current[y1 * w + x0] + current[y1 * w + x1]) * 0.25f;
+                }
+            }
+            current.swap(next);
+            w = nw;
+            h = nh;
+        }
+    }
+    int levelCount() const
+    {
+        return (int)levels.size();
+    }
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (const auto &level : levels)
+        {
+            total += level.bytes();
+        }
+        return total;
+    }
+    // mip level for a footprint of `footprint` world units on a surface that maps
+    // `texels_per_unit` level-0 texels onto one world unit
+    float LevelOfDetail(float footprint, float texels_per_unit) const
+    {
+        float texels = footprint * texels_per_unit;
+        if (!(texels > 1.0f))
+        {
+            return 0.0f;
+        }
+        return std::min(std::log2(texels), (float)(levels.size() - 1));
+    }
+    // trilinear lookup, u and v in [0, 1] with clamp-to-edge addressing, except that u repeats
+    // with wrap_u, e.g. for a longitude, so the texels on both sides of u = 0 are blended
+    Color Sample(float u, float v, float lod = 0.0f, bool wrap_u = false) const
+    {
+        if (levels.empty())
+        {
+            return Color();
+        }
+        int l0 = (int)lod;
+        float frac = lod - (float)l0;
+        Color c0 = Bilinear(levels[l0], u, v, wrap_u);
+        if (frac <= 0.0f || l0 + 1 >= (int)levels.size())
+        {
+            return c0;
+        }
+        return Color::Lerp(c0, Bilinear(levels[l0 + 1], u, v, wrap_u), frac);
+    }
+    int width, height;
+    std::string name;
+
+private:
+    static MipLevel quantize(const std::vector<Color> &pixels, int w, int h)
+    {
+        auto to_byte = [](float c)
+        {
+            return (uint8_t)std::lround(std::min(std::max(c, 0.0f), 1.0f) * 255.0f);
+        };
+        MipLevel level(w, h);
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                const Color &c = pixels[y * w + x];
+                level.setTexel(x, y, {to_byte(c.R), to_byte(c.G), to_byte(c.B), 255});
+            }
+        }
+        return level;
+    }
+    static Color Bilinear(const MipLevel &level, float u, float v, bool wrap_u)
+    {
+        float x = (wrap_u ? u - std::floor(u) : std::min(std::max(u, 0.0f), 1.0f)) * level.width - 0.5f;
+        float y = std::min(std::max(v, 0.0f), 1.0f) * level.height - 0.5f;
+        int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+        float fx = x - (float)x0, fy = y - (float)y0;
+        int x1, y1 = std::min(y0 + 1, level.height - 1);
+        if (wrap_u)
+        {
+            // x0 is at least -1, and u - floor(u) may round up to 1
+            x0 = (x0 + level.width) % level.width;
+            x1 = (x0 + 1) % level.width;
+        }
+        else
+        {
+            x1 = std::min(x0 + 1, level.width - 1);
+            x0 = std::max(x0, 0);
+        }
+        y0 = std::max(y0, 0);
+        const Texel &t00 = level.fetch(x0, y0), &t10 = level.fetch(x1, y0);
+        const Texel &t01 = level.fetch(x0, y1), &t11 = level.fetch(x1, y1);
+        float w00 = (1 - fx) * (1 - fy), w10 = fx * (1 - fy), w01 = (1 - fx) * fy, w11 = fx * fy;
+        constexpr float inv = 1.0f / 255.0f;
+        return Color((t00.r * w00 + t10.r * w10 + t01.r * w01 + t11.r * w11) * inv,
+                     (t00.g * w00 + t10.g * w10 + t01.g * w01 + t11.g * w11) * inv,
+                     (t00.b * w00 + t10.b * w10 + t01.b * w01 + t11.b * w11) * inv);
+    }
+    std::vector<MipLevel> levels;
+};
+
+// Process-wide texture store. Files are deduplicated by path and only decoded the first
+// time something samples them. A thread takes the cache lock only for the first lookup of a
+// texture in a tile: the handle is then pinned in a per-thread table, later hits read it from
+// there without touching shared state, and Unpin drops the table when the tile is done. When
+// a budget is set, textures are dropped in clock order (a second chance for every texture
+// pinned since the hand last passed it) until the resident set fits again, which costs O(1)
+// per eviction on average; a texture that is still pinned or being sampled stays alive
+// through the shared_ptr handed out by Acquire.
+class TextureCache
+{
+public:
+    static TextureCache &Global()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+    // budget in bytes, 0 means unlimited
+    void SetBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        evict(-1);
+    }
+    // returns the handle for `path`, registering it if this is the first reference
+    int Register(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_path.find(path);
+        if (it != by_path.end())
+        {
+            return it->second;
+        }
+        // fail at parse time rather than in the middle of a render
+        if (!std::ifstream(path))
+        {
+            std::cerr << "Failed to open file " << path << std::endl;
+            exit(1);
+        }
+        entries.push_back(std::make_unique<Entry>());
+        entries.back()->path = path;
+        int handle = (int)entries.size() - 1;
+        by_path[path] = handle;
+        return handle;
+    }
+    std::shared_ptr<const Texture> Acquire(int handle)
+    {
+        Pins &pins = thread_pins();
+        if (handle < (int)pins.textures.size() && pins.textures[handle])
+        {
+            pins.hits++;
+            return pins.textures[handle];
+        }
+        auto texture = lookup(handle);
+        if (handle >= (int)pins.textures.size())
+        {
+            pins.textures.resize(handle + 1);
+        }
+        pins.textures[handle] = texture;
+        pins.handles.push_back(handle);
+        return texture;
+    }
+    // drops the calling thread's pins; call when it finishes a tile, so the textures evicted
+    // meanwhile are freed and the next tile looks its textures up again
+    void Unpin()
+    {
+        Pins &pins = thread_pins();
+        for (int handle : pins.handles)
+        {
+            pins.textures[handle].reset();
+        }
+        pins.handles.clear();
+        hits.fetch_add(pins.hits, std::memory_order_relaxed);
+        pins.hits = 0;
+    }
+    const std::string &Path(int handle)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries[handle]->path;
+    }
+    void PrintStats(std::ostream &os)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        os << "textures: " << entries.size() << " registered, " << loads << " loads, " << evictions
+           << " evictions, " << hits.load(std::memory_order_relaxed) << " hits, " << resident / (1024 * 1024)
+           << " MB resident" << std::endl;
+    }
+
+private:
+    struct Entry
+    {
+        std::string path;
+        std::shared_ptr<const Texture> texture;
+        std::mutex load_mutex;
+        // set whenever a thread pins the texture, cleared when the clock hand passes it
+        bool referenced = false;
+        size_t bytes = 0;
+    };
+    // this thread's pinned textures by handle, the handles pinned so far and the hits on them
+    // not yet added to `hits`
+    struct Pins
+    {
+        std::vector<std::shared_ptr<const Texture>> textures;
+        std::vector<int> handles;
+        uint64_t hits = 0;
+    };
+    static Pins &thread_pins()
+    {
+        thread_local Pins pins;
+        return pins;
+    }
+    std::shared_ptr<const Texture> lookup(int handle)
+    {
+        Entry *entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            entry = entries[handle].get();
+            entry->referenced = true;
+            if (entry->texture)
+            {
+                hits++;
+                return entry->texture;
+            }
+        }
+        // decode outside the cache lock so other textures stay available meanwhile
+        std::lock_guard<std::mutex> load_lock(entry->load_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (entry->texture)
+            {
+                hits++;
+                return entry->texture;
+            }
+        }
+        auto texture = std::make_shared<const Texture>(Image::ReadPPM(entry->path));
+        std::lock_guard<std::mutex> lock(mutex);
+        entry->texture = texture;
+        entry->bytes = texture->bytes();
+        resident += entry->bytes;
+        resident_entries.push_back(handle);
+        loads++;
+        evict(handle);
+        return texture;
+    }
+    // drop textures in clock order until under budget, never touching `keep`; a texture
+    // pinned since the hand last passed it is skipped once, and after a full sweep of skips
+    // the next candidate goes regardless so new pins cannot hold the hand off forever
+    void evict(int keep)
+    {
+        size_t skipped = 0;
+        while (budget != 0 && resident > budget)
+        {
+            if (resident_entries.empty() || (resident_entries.size() == 1 && resident_entries[0] == keep))
+            {
+                return;
+            }
+            if (hand >= resident_entries.size())
+            {
+                hand = 0;
+            }
+            int e = resident_entries[hand];
+            Entry &entry = *entries[e];
+            if (e == keep || (skipped < resident_entries.size() && entry.referenced))
+            {
+                entry.referenced = false;
+                hand++;
+                skipped++;
+                continue;
+            }
+            entry.texture.reset();
+            resident -= entry.bytes;
+            evictions++;
+            resident_entries[hand] = resident_entries.back();
+            resident_entries.pop_back();
+            skipped = 0;
+        }
+    }
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Entry>> entries;
+    // handles of the resident textures, in clock order
+    std::vector<int> resident_entries;
+    size_t hand = 0;
+    std::map<std::string, int> by_path;
+    size_t budget = 0;
+    size_t resident = 0;
+    uint64_t loads = 0, evictions = 0;
+    std::atomic<uint64_t> hits{0};
+};
@@ -0,0 +1,281 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// CPUs this process may run on, grouped by NUMA node. Read from sysfs on Linux; anywhere else,
+// or if sysfs is missing, every CPU is on node 0.
+struct CpuTopology
+{
+    // cpus[node] lists the usable CPUs of that node
+    std::vector<std::vector<int>> cpus;
+
+    static CpuTopology Detect()
+    {
+        CpuTopology topology;
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        {
+            for (int node = 0;; node++)
+            {
+                std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                std::string list;
+                if (!(file >> list))
+                {
+                    break;
+                }
+                std::vector<int> cpus;
+                for (int cpu : parseList(list))
+                {
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    {
+                        cpus.push_back(cpu);
+                    }
+                }
+                if (!cpus.empty())
+                {
+                    topology.cpus.push_back(cpus);
+                }
+            }
+            if (topology.cpus.empty())
+            {
+                topology.cpus.emplace_back();
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                {
+                    if (CPU_ISSET(cpu, &allowed))
+                    {
+                        topology.cpus[0].push_back(cpu);
+                    }
+                }
+            }
+        }
+#endif
+        if (topology.cpus.empty() || topology.cpus[0].empty())
+        {
+            topology.cpus.assign(1, {});
+            for (int cpu = 0; cpu < (int)std::max(1u, std::thread::hardware_concurrency()); cpu++)
+            {
+                topology.cpus[0].push_back(cpu);
+            }
+        }
+        return topology;
+    }
+    int CpuCount() const
+    {
+        int count = 0;
+        for (const auto &node : cpus)
+        {
+            count += (int)node.size();
+        }
+        return count;
+    }
+
+private:
+    // "0-3,8,10-11"
+    static std::vector<int> parseList(const std::string &list)
+    {
+        std::vector<int> cpus;
+        size_t pos = 0;
+        while (pos < list.size())
+        {
+            size_t end = list.find(',', pos);
+            std::string range = list.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+            size_t dash = range.find('-');
+            int lo = std::atoi(range.c_str());
+            int hi = dash == std::string::npos ? lo : std::atoi(range.c_str() + dash + 1);
+            for (int cpu = lo; cpu <= hi; cpu++)
+            {
+                cpus.push_back(cpu);
+            }
+            if (end == std::string::npos)
+            {
+                break;
+            }
+            pos = end + 1;
+        }
+        return cpus;
+    }
+};
+
+// Fixed set of worker threads kept alive between renders. The calling thread takes part in
+// every ParallelFor, so a pool of size 1 runs everything inline.
+//
+// With pinning, threads are bound to CPUs round robin across NUMA nodes, and ParallelFor
+// splits the indices into one contiguous band per node, sized by its thread count. A thread
+// takes work from its own node's band first and only then helps the others, so on a
+// multi-socket machine each socket renders a contiguous part of the image and first touches
+// the textures and mesh clusters it loads on the way. Unpinned, or on a single node, there is
+// one band and indices are handed out in order as before.
+class ThreadPool
+{
+public:
+    // num_threads <= 0 means one per CPU this process may run on
+    explicit ThreadPool(int num_threads = 0, bool pin = false) : topology(CpuTopology::Detect())
+    {
+        if (num_threads <= 0)
+        {
+            num_threads = topology.CpuCount();
+        }
+        pinned = pin;
+        // thread k runs on the (k / nodes)th CPU of node k % nodes
+        int nodes = pin ? (int)topology.cpus.size() : 1;
+        node_of.resize(num_threads);
+        bands = std::make_unique<Band[]>(nodes);
+        band_count = nodes;
+        for (int k = 0; k < num_threads; k++)
+        {
+            node_of[k] = k % nodes;
+            bands[node_of[k]].threads++;
+        }
+        if (pin)
+        {
+            pinTo(0);
+        }
+        for (int i = 1; i < num_threads; i++)
+        {
+            threads.emplace_back(&ThreadPool::worker, this, i);
+        }
+    }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int Size() const
+    {
+        return (int)threads.size() + 1;
+    }
+    // NUMA nodes the threads are spread over, 1 unless pinned
+    int Nodes() const
+    {
+        return band_count;
+    }
+    void PrintStats(std::ostream &os) const
+    {
+        os << "threads: " << Size() << (pinned ? " pinned" : "") << " on " << topology.CpuCount() << " CPUs, "
+           << topology.cpus.size() << " NUMA nodes" << std::endl;
+    }
+    // run fn(i) for every i in [0, count) and return once all calls have finished;
+    // indices are handed out dynamically, so uneven work balances itself
+    void ParallelFor(int count, const std::function<void(int)> &fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            int begin = 0;
+            for (int b = 0; b < band_count; b++)
+            {
+                int end = b == band_count - 1 ? count : begin + (int)((int64_t)count * bands[b].threads / Size());
+                bands[b].next = begin;
+                bands[b].end = end;
+                begin = end;
+            }
+            active = (int)threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        drain(fn, 0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]
+                  { return active == 0; });
+        job = nullptr;
+    }
+
+private:
+    struct Band
+    {
+        std::atomic<int> next{0};
+        int end = 0;
+        int threads = 0;
+    };
+    void pinTo(int k)
+    {
+#ifdef __linux__
+        const std::vector<int> &cpus = topology.cpus[node_of[k]];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[(k / band_count) % cpus.size()], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)k;
+#endif
+    }
+    // own band first, then the others'
+    void drain(const std::function<void(int)> &fn, int k)
+    {
+        for (int b = 0; b < band_count; b++)
+        {
+            Band &band = bands[(node_of[k] + b) % band_count];
+            for (int i = band.next++; i < band.end; i = band.next++)
+            {
+                fn(i);
+            }
+        }
+    }
+    void worker(int k)
+    {
+        if (pinned)
+        {
+            pinTo(k);
+        }
+        uint64_t seen = 0;
+        while (true)
+        {
+            const std::function<void(int)> *fn;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]
+                          { return stop || generation != seen; });
+                if (stop)
+                {
+                    return;
+                }
+                seen = generation;
+                fn = job;
+            }
+            drain(*fn, k);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+            }
+            done.notify_one();
+        }
+    }
+    CpuTopology topology;
+    bool pinned = false;
+    // NUMA node (band) of thread k; thread 0 is the one that calls ParallelFor
+    std::vector<int> node_of;
+    std::unique_ptr<Band[]> bands;
+    int band_count = 1;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(int)> *job = nullptr;
+    int active = 0;
+    uint64_t generation = 0;
+    bool stop = false;
+};
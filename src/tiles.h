@@ -0,0 +1,198 @@
+#pragma once
+#include "image.h"
+#include "input.h"
+#include "options.h"
+#include "render.h"
+#include "threadpool.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Splitting one frame across processes that share a directory:
+//   raytracer scene.txt --split DIR [--tile-size N]   write DIR/manifest
+//   raytracer scene.txt --worker DIR                   (any number, any host) render tiles
+//   raytracer --merge DIR [-o out.ppm]                 assemble DIR/tile_K.ppm into one image
+// The manifest is "imsize W H" followed by one "tile X0 Y0 X1 Y1" line per tile. A worker
+// claims tile K by creating DIR/tile_K.lock with O_EXCL, which is atomic on a shared
+// filesystem, and publishes the result by renaming DIR/tile_K.ppm.tmp to DIR/tile_K.ppm, so
+// the merge never sees half written tiles. A worker that dies leaves a lock without a tile;
+// delete the lock and run another worker to redo it.
+struct TileManifest
+{
+    int width = 0, height = 0;
+    std::vector<Region> tiles;
+};
+
+static std::string tile_path(const std::string &dir, size_t tile, const char *suffix)
+{
+    return dir + "/tile_" + std::to_string(tile) + suffix;
+}
+
+TileManifest read_manifest(const std::string &dir)
+{
+    std::string path = dir + "/manifest";
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Unable to open file " << path << std::endl;
+        exit(1);
+    }
+    TileManifest manifest;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream iss(line);
+        std::string key;
+        if (!(iss >> key) || key[0] == '#')
+        {
+            continue;
+        }
+        Region r;
+        if (key == "imsize" && iss >> manifest.width >> manifest.height)
+        {
+            continue;
+        }
+        if (key == "tile" && iss >> r.x0 >> r.y0 >> r.x1 >> r.y1 && r.x0 >= 0 && r.y0 >= 0 &&
+            r.x1 <= manifest.width && r.y1 <= manifest.height && r.Width() > 0 && r.Height() > 0)
+        {
+            manifest.tiles.push_back(r);
+            continue;
+        }
+        std::cerr << "Invalid line in " << path << ": " << line << std::endl;
+        exit(1);
+    }
+    return manifest;
+}
+
+// cut the view's image into tile_size squares and write the manifest for the workers
+int WriteManifest(const std::string &dir, const InputFileData &input, const ViewOverride &view_override, int tile_size)
+{
+    auto view = ResolveView(input, view_override);
+    if (!view || tile_size <= 0)
+    {
+        std::cerr << "Invalid imsize, region or tile size" << std::endl;
+        return 1;
+    }
+    const Region &r = view->region;
+    std::ofstream file(dir + "/manifest", std::ios::out | std::ios::trunc);
+    if (!file)
+    {
+        std::cerr << "Unable to write " << dir << "/manifest" << std::endl;
+        return 1;
+    }
+    file << "imsize " << view->camera.image_width << " " << view->camera.image_height << std::endl;
+    int count = 0;
+    for (int y = r.y0; y < r.y1; y += tile_size)
+    {
+        for (int x = r.x0; x < r.x1; x += tile_size)
+        {
+            file << "tile " << x << " " << y << " " << std::min(x + tile_size, r.x1) << " "
+                 << std::min(y + tile_size, r.y1) << std::endl;
+            count++;
+        }
+    }
+    std::cout << "Wrote " << count << " tiles to " << dir << "/manifest" << std::endl;
+    return 0;
+}
+
+// claim and render tiles until none are left unclaimed
+int RunWorker(const std::string &dir, InputFileData &input, const ViewOverride &view_override, ThreadPool &pool)
+{
+    TileManifest manifest = read_manifest(dir);
+    int rendered = 0;
+    for (size_t k = 0; k < manifest.tiles.size(); k++)
+    {
+        std::string lock = tile_path(dir, k, ".lock");
+        int fd = ::open(lock.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0)
+        {
+            if (errno == EEXIST)
+            {
+                continue;
+            }
+            std::cerr << "Failed to create " << lock << ": " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        std::string owner = std::to_string(::getpid()) + "\n";
+        (void)!::write(fd, owner.data(), owner.size());
+        ::close(fd);
+
+        const Region &tile = manifest.tiles[k];
+        ViewOverride tile_view = view_override;
+        tile_view.fields |= VIEW_IMSIZE | VIEW_REGION;
+        tile_view.imsize[0] = manifest.width;
+        tile_view.imsize[1] = manifest.height;
+        tile_view.region[0] = tile.x0;
+        tile_view.region[1] = tile.y0;
+        tile_view.region[2] = tile.x1;
+        tile_view.region[3] = tile.y1;
+        auto view = ResolveView(input, tile_view);
+        if (!view)
+        {
+            std::cerr << "Tile " << k << " does not fit the image" << std::endl;
+            return 1;
+        }
+        Image image(tile.Width(), tile.Height());
+        image.origin_x = tile.x0;
+        image.origin_y = tile.y0;
+        image.fill(input.bkgcolor);
+        RenderRegion(input, view->camera, view->region, image, pool);
+        std::string tmp = tile_path(dir, k, ".ppm.tmp");
+        image.save(tmp, &pool);
+        if (std::rename(tmp.c_str(), tile_path(dir, k, ".ppm").c_str()) != 0)
+        {
+            std::cerr << "Failed to publish tile " << k << ": " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        rendered++;
+    }
+    std::cout << "Worker " << ::getpid() << " rendered " << rendered << " tiles" << std::endl;
+    return 0;
+}
+
+// Assemble the finished tiles. Pixels are copied as 8-bit values, so the result matches a
+// single-process render exactly; pixels outside every tile stay black.
+int MergeTiles(const std::string &dir, const std::string &output)
+{
+    TileManifest manifest = read_manifest(dir);
+    std::vector<uint8_t> frame((size_t)manifest.width * manifest.height * 3, 0);
+    int missing = 0;
+    for (size_t k = 0; k < manifest.tiles.size(); k++)
+    {
+        std::string path = tile_path(dir, k, ".ppm");
+        if (!std::ifstream(path))
+        {
+            std::cerr << "Missing " << path << std::endl;
+            missing++;
+            continue;
+        }
+        const Region &tile = manifest.tiles[k];
+        int w, h;
+        std::vector<uint8_t> bytes = Image::ReadRGB8(path, w, h);
+        if (w != tile.Width() || h != tile.Height())
+        {
+            std::cerr << path << " is " << w << "x" << h << ", expected " << tile.Width() << "x" << tile.Height() << std::endl;
+            return 1;
+        }
+        for (int y = 0; y < h; y++)
+        {
+            std::memcpy(&frame[((size_t)(tile.y0 + y) * manifest.width + tile.x0) * 3], &bytes[(size_t)y * w * 3], (size_t)w * 3);
+        }
+    }
+    if (missing > 0)
+    {
+        std::cerr << missing << " of " << manifest.tiles.size() << " tiles missing, not merging" << std::endl;
+        return 1;
+    }
+    Image::SaveRGB8(output, manifest.width, manifest.height, frame);
+    std::cout << "Image saved to " << output << std::endl;
+    return 0;
+}
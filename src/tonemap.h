@@ -0,0 +1,147 @@
+#pragma once
+#include "color.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Float framebuffer to 8-bit RGB in one pass over whole rows: exposure, clamping to [0, 1], an
+// optional gamma or sRGB curve, optional ordered dithering, then truncation to 0..255. The
+// default settings truncate exactly like Color::scale_color, so images are unchanged unless
+// an option is given. Rows are treated as flat float arrays, four channels per SSE2 vector;
+// the dither pattern repeats every 4 pixels, i.e. every 3 vectors.
+static_assert(sizeof(Color) == 3 * sizeof(float), "rows of Color are converted as flat float arrays");
+
+struct ToneMap
+{
+    enum Curve
+    {
+        LINEAR,
+        GAMMA,
+        SRGB
+    };
+    // stops; every pixel is scaled by 2^exposure before clamping
+    float exposure = 0;
+    // 4x4 Bayer offsets added before truncation, so smooth gradients do not band
+    bool dither = false;
+
+    // gamma is only used with GAMMA; builds the lookup table, so call it before converting
+    void SetCurve(Curve c, float g = 2.2f)
+    {
+        curve = c;
+        gamma = g;
+        lut.clear();
+        if (curve != LINEAR)
+        {
+            buildLut();
+        }
+    }
+
+    // the tone map images are written with, set from the command line
+    static ToneMap &Output()
+    {
+        static ToneMap tone;
+        return tone;
+    }
+
+    // width pixels of one row to 3 * width bytes; (x, y) is the row's first pixel in the full
+    // image, so tiles dither the same as a single render
+    void ConvertRow(const Color *row, int width, int x, int y, uint8_t *out) const
+    {
+        const float *in = &row[0].R;
+        int n = width * 3;
+        float dither_row[12];
+        for (int k = 0; k < 12; k++)
+        {
+            dither_row[k] = dither ? kBayer[y & 3][(x + k / 3) & 3] : 0.0f;
+        }
+        float scale = std::exp2(exposure);
+        int k = 0;
+#ifdef __SSE2__
+        if (curve == LINEAR)
+        {
+            const __m128 vscale = _mm_set1_ps(scale), zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f),
+                         v255 = _mm_set1_ps(255.0f);
+            const __m128 d[3] = {_mm_loadu_ps(dither_row), _mm_loadu_ps(dither_row + 4), _mm_loadu_ps(dither_row + 8)};
+            for (; k + 12 <= n; k += 12)
+            {
+                __m128i q[3];
+                for (int m = 0; m < 3; m++)
+                {
+                    __m128 v = _mm_loadu_ps(in + k + 4 * m);
+                    if (exposure != 0)
+                    {
+                        v = _mm_mul_ps(v, vscale);
+                    }
+                    v = _mm_min_ps(_mm_max_ps(v, zero), one);
+                    q[m] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, v255), d[m]));
+                }
+                // saturating packs clamp a dithered 255.x back to 255
+                __m128i words0 = _mm_packs_epi32(q[0], q[1]);
+                __m128i words1 = _mm_packs_epi32(q[2], q[2]);
+                alignas(16) uint8_t bytes[16];
+                _mm_store_si128(reinterpret_cast<__m128i *>(bytes), _mm_packus_epi16(words0, words1));
+                std::copy(bytes, bytes + 12, out + k);
+            }
+        }
+        else
+        {
+            const __m128 vscale = _mm_set1_ps(scale), zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f),
+                         vsize = _mm_set1_ps((float)(kLutSize - 1)), half = _mm_set1_ps(0.5f);
+            // SSE2 has no gather, so only the table indices are computed four at a time
+            for (; k + 12 <= n; k += 12)
+            {
+                alignas(16) int32_t index[12];
+                for (int m = 0; m < 3; m++)
+                {
+                    __m128 v = _mm_mul_ps(_mm_loadu_ps(in + k + 4 * m), vscale);
+                    v = _mm_min_ps(_mm_max_ps(v, zero), one);
+                    _mm_store_si128(reinterpret_cast<__m128i *>(index + 4 * m), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, vsize), half)));
+                }
+                for (int m = 0; m < 12; m++)
+                {
+                    out[k + m] = (uint8_t)std::min(lut[index[m]] + dither_row[m], 255.0f);
+                }
+            }
+        }
+#endif
+        for (; k < n; k++)
+        {
+            float v = std::min(std::max(exposure != 0 ? in[k] * scale : in[k], 0.0f), 1.0f);
+            float q = curve == LINEAR ? v * 255 : lut[(int)(v * (kLutSize - 1) + 0.5f)];
+            out[k] = (uint8_t)std::min(q + dither_row[k % 12], 255.0f);
+        }
+    }
+
+private:
+    static constexpr int kLutSize = 4096;
+    // (i + 0.5) / 16, so every offset is below 1 and their mean is 0.5
+    static constexpr float kBayer[4][4] = {{0.03125f, 0.53125f, 0.15625f, 0.65625f},
+                                           {0.78125f, 0.28125f, 0.90625f, 0.40625f},
+                                           {0.21875f, 0.71875f, 0.09375f, 0.59375f},
+                                           {0.96875f, 0.46875f, 0.84375f, 0.34375f}};
+    // 255 * curve(i / (kLutSize - 1))
+    void buildLut()
+    {
+        lut.resize(kLutSize);
+        for (int i = 0; i < kLutSize; i++)
+        {
+            double v = (double)i / (kLutSize - 1);
+            if (curve == SRGB)
+            {
+                v = v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+            }
+            else
+            {
+                v = std::pow(v, 1.0 / gamma);
+            }
+            lut[i] = (float)(255 * v);
+        }
+    }
+    Curve curve = LINEAR;
+    float gamma = 2.2f;
+    std::vector<float> lut;
+};
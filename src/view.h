@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+
+// camera and framing changes on top of what the scene file says; also the body of a render
+// server request, so it stays plain data
+enum ViewField : uint32_t
+{
+    VIEW_EYE = 1 << 0,
+    VIEW_VIEWDIR = 1 << 1,
+    VIEW_UPDIR = 1 << 2,
+    VIEW_HFOV = 1 << 3,
+    VIEW_IMSIZE = 1 << 4,
+    VIEW_REGION = 1 << 5
+};
+struct ViewOverride
+{
+    uint32_t fields = 0;
+    double eye[3] = {0, 0, 0};
+    double viewdir[3] = {0, 0, 0};
+    double updir[3] = {0, 0, 0};
+    double hfov = 0;
+    int32_t imsize[2] = {0, 0};
+    // x0 y0 x1 y1, half open
+    int32_t region[4] = {0, 0, 0, 0};
+};
@@ -0,0 +1,536 @@
+#pragma once
+#include "bvh.h"
+#include "image.h"
+#include "input.h"
+#include "rays.h"
+#include "render.h"
+#include "texture.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Breadth-first alternative to RenderRegion. Each tile is traced one bounce at a time: the
+// rays of a bounce are sorted by direction octant and the Morton code of their origin and
+// intersected together, then their hits are sorted by shader and material and shaded
+// together, which queues the next bounce. Neighbouring rays in a queue walk the same BVH
+// nodes and run the same shader on the same material back to back, instead of each pixel
+// jumping between all of them while it recurses.
+//
+// A queued ray carries the product of the factors the recursive shader would apply to its
+// result (k_specular, Fresnel terms), and every shaded hit adds its local illumination times
+// that weight to its pixel. The sum is the same as RenderRegion's up to the rounding of those
+// products. Nothing is recorded for incremental re-rendering.
+
+// a ray waiting to be intersected; depth counts as in TraceRay
+struct WavefrontRay
+{
+    Ray ray;
+    Real weight;
+    int pixel;
+    int depth;
+    uint64_t key;
+};
+
+// a hit waiting to be shaded; depth counts as in ShadeRayT
+struct WavefrontHit
+{
+    Ray ray;
+    RayResult hit;
+    Real weight;
+    int pixel;
+    int depth;
+    std::vector<Real> ior_stack;
+    uint64_t key;
+};
+
+// what shading one bounce produces
+struct WavefrontQueues
+{
+    std::vector<WavefrontRay> rays;
+    std::vector<WavefrontHit> hits;
+    std::vector<Color> pixels;
+};
+
+// 10 bits per axis of p inside `bounds`, interleaved
+static uint32_t MortonCode(const Point &p, const AABB &bounds)
+{
+    uint32_t code = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        Real lo = (&bounds.min.x)[axis], hi = (&bounds.max.x)[axis];
+        Real x = hi > lo ? ((&p.x)[axis] - lo) / (hi - lo) : 0;
+        uint32_t v = (uint32_t)std::clamp(x * 1024, Real(0), Real(1023));
+        // spread the 10 bits three apart
+        v = (v | (v << 16)) & 0x030000FFu;
+        v = (v | (v << 8)) & 0x0300F00Fu;
+        v = (v | (v << 4)) & 0x030C30C3u;
+        v = (v | (v << 2)) & 0x09249249u;
+        code |= v << axis;
+    }
+    return code;
+}
+
+static uint64_t RayKey(const Ray &ray, const AABB &bounds, int pixel)
+{
+    uint64_t octant = (ray.direction.x < 0) | (ray.direction.y < 0) << 1 | (ray.direction.z < 0) << 2;
+    return octant << 61 | (uint64_t)MortonCode(ray.origin, bounds) << 31 | (uint64_t)pixel;
+}
+
+static uint64_t HitKey(const Object &object, int pixel)
+{
+    uint64_t material = (uint32_t)(shading_material(object).id + 1);
+    return (uint64_t)object.shader_features << 56 | material << 31 | (uint64_t)pixel;
+}
+
+// IntersectScene for a whole queue, with packed meshes intersected one cluster at a time. The
+// first pass intersects everything else and notes every cluster a ray enters; the second
+// acquires each noted cluster once and intersects all the rays that reached it. A cluster is
+// then paged in once per bounce of a band, not once for every ray that comes back to it after
+// the cache dropped it.
+static void IntersectBatch(const InputFileData &input, std::vector<WavefrontRay> &rays, std::vector<RayResult> &hits)
+{
+    struct ClusterVisit
+    {
+        const MeshFile::Cluster *cluster;
+        Instance *instance;
+        int ray;
+    };
+    std::vector<ClusterVisit> visits;
+    hits.assign(rays.size(), RayResult());
+    for (int k = 0; k < (int)rays.size(); k++)
+    {
+        RayResult &res = hits[k];
+        res.t = -1;
+        Ray &ray = rays[k].ray;
+        if (rays[k].depth >= MAX_DEPTH)
+        {
+            continue;
+        }
+        SceneBVH(input, rays[k].depth).Traverse(ray.origin, ray.direction, ray.t_min, ray.t_max, [&](Object *obj)
+                                                {
+            const MeshFile *file = obj->type == ObjectType::INSTANCE ? static_cast<Instance *>(obj)->mesh->file.get() : nullptr;
+            if (file)
+            {
+                auto instance = static_cast<Instance *>(obj);
+                Ray local = ray.ToLocal(*instance);
+                file->bvh.Traverse(local.origin, local.direction, local.t_min, res.t > 0 ? res.t : local.t_max,
+                                   [&](const MeshFile::Cluster *cluster)
+                                   {
+                    visits.push_back({cluster, instance, k});
+                    return res.t > 0 ? res.t : local.t_max; });
+            }
+            else
+            {
+                auto temp_res = ray.Intersect(obj);
+                if (temp_res.t > 0 && (res.t < 0 || temp_res.t < res.t))
+                {
+                    res = temp_res;
+                    res.object = obj;
+                }
+            }
+            return res.t > 0 ? res.t : ray.t_max; });
+    }
+    // clusters in file order, so reads also follow the file
+    std::sort(visits.begin(), visits.end(), [](const ClusterVisit &a, const ClusterVisit &b)
+              { return a.cluster->handle != b.cluster->handle ? a.cluster->handle < b.cluster->handle : a.ray < b.ray; });
+    for (size_t v = 0; v < visits.size();)
+    {
+        const MeshFile::Cluster *cluster = visits[v].cluster;
+        const MeshFile &file = *visits[v].instance->mesh->file;
+        std::shared_ptr<const MeshCluster> resident = file.Acquire(*cluster);
+        for (; v < visits.size() && visits[v].cluster == cluster; v++)
+        {
+            RayResult &res = hits[visits[v].ray];
+            const Ray &ray = rays[visits[v].ray].ray;
+            Ray local = ray.ToLocal(*visits[v].instance);
+            if (res.t > 0)
+            {
+                local.t_max = res.t;
+            }
+            RayResult mesh_hit;
+            mesh_hit.t = -1;
+            ray.IntersectCluster(local, file, resident, mesh_hit);
+            if (mesh_hit.t > 0 && (res.t < 0 || mesh_hit.t < res.t))
+            {
+                mesh_hit.object = visits[v].instance;
+                if (file.position_bits == 0)
+                {
+                    Ray::ToWorld(*visits[v].instance, mesh_hit);
+                }
+                res = std::move(mesh_hit);
+            }
+        }
+    }
+    for (int k = 0; k < (int)rays.size(); k++)
+    {
+        rays[k].ray.Resolve(hits[k]);
+    }
+}
+
+// The transmittance ShadeLocalT would find for every unanswered query in `shadows`, with
+// packed meshes intersected one cluster at a time as in IntersectBatch. The factors of a ray
+// are multiplied in the order the BVH reaches their objects, with the same early out, so the
+// answers are exactly those of tracing the rays one by one.
+static void AnswerShadows(const InputFileData &input, std::vector<ShadowQueries> &shadows)
+{
+    std::vector<ShadowQueries::Query *> queries;
+    for (ShadowQueries &q : shadows)
+    {
+        for (size_t k = q.answered; k < q.queries.size(); k++)
+        {
+            queries.push_back(&q.queries[k]);
+        }
+        q.answered = q.queries.size();
+    }
+    // a blocker of query `ray`, the `order`-th object the BVH reached for it
+    struct Factor
+    {
+        int ray;
+        int order;
+        Real factor;
+    };
+    struct ClusterVisit
+    {
+        const MeshFile::Cluster *cluster;
+        Instance *instance;
+        int ray;
+        int order;
+    };
+    std::vector<Factor> factors;
+    std::vector<ClusterVisit> visits;
+    for (int k = 0; k < (int)queries.size(); k++)
+    {
+        Ray &ray = queries[k]->ray;
+        int order = 0;
+        input.bvh.Traverse(ray.origin, ray.direction, ray.t_min, ray.t_max, [&](Object *obj)
+                           {
+            const MeshFile *file = obj->type == ObjectType::INSTANCE ? static_cast<Instance *>(obj)->mesh->file.get() : nullptr;
+            if (file)
+            {
+                auto instance = static_cast<Instance *>(obj);
+                Ray local = ray.ToLocal(*instance);
+                file->bvh.Traverse(local.origin, local.direction, local.t_min, local.t_max, [&](const MeshFile::Cluster *cluster)
+                                   {
+                    visits.push_back({cluster, instance, k, order});
+                    return local.t_max; });
+            }
+            else if (ray.Intersect(obj).t > 0)
+            {
+                factors.push_back({k, order, 1 - shading_material(*obj).alpha});
+            }
+            order++;
+            return ray.t_max; });
+    }
+    std::sort(visits.begin(), visits.end(), [](const ClusterVisit &a, const ClusterVisit &b)
+              { return a.cluster->handle != b.cluster->handle ? a.cluster->handle < b.cluster->handle : a.ray < b.ray; });
+    for (size_t v = 0; v < visits.size();)
+    {
+        const MeshFile::Cluster *cluster = visits[v].cluster;
+        const MeshFile &file = *visits[v].instance->mesh->file;
+        std::shared_ptr<const MeshCluster> resident = file.Acquire(*cluster);
+        for (; v < visits.size() && visits[v].cluster == cluster; v++)
+        {
+            const Ray &ray = queries[visits[v].ray]->ray;
+            Ray local = ray.ToLocal(*visits[v].instance);
+            RayResult hit;
+            hit.t = -1;
+            ray.IntersectCluster(local, file, resident, hit);
+            if (hit.t > 0)
+            {
+                factors.push_back({visits[v].ray, visits[v].order, 1 - visits[v].instance->material.alpha});
+            }
+        }
+    }
+    // an instance hit in several clusters blocks once
+    std::sort(factors.begin(), factors.end(), [](const Factor &a, const Factor &b)
+              { return a.ray != b.ray ? a.ray < b.ray : a.order < b.order; });
+    for (size_t f = 0; f < factors.size();)
+    {
+        int k = factors[f].ray;
+        Real opacity = 1;
+        for (int order = -1; f < factors.size() && factors[f].ray == k; f++)
+        {
+            if (factors[f].order != order && opacity >= Real(0.01))
+            {
+                order = factors[f].order;
+                opacity *= factors[f].factor;
+            }
+        }
+        queries[k]->transmittance = std::clamp(opacity, Real(0), Real(1));
+    }
+}
+
+static void QueueRay(WavefrontQueues &out, const Ray &ray, Real weight, int pixel, int depth, const AABB &bounds)
+{
+    out.rays.push_back({ray, weight, pixel, depth, RayKey(ray, bounds, pixel)});
+}
+
+// ShadeRayT with its recursion turned into queued work
+template <ObjectType Type, unsigned Features>
+void ShadeWavefrontT(WavefrontHit &h, InputFileData &input, const Texture *texture, const AABB &bounds, WavefrontQueues &out)
+{
+    constexpr bool reflective = Features & SHADE_REFLECTIVE;
+    constexpr bool refractive = Features & SHADE_REFRACTIVE;
+
+    Color &pixel = out.pixels[h.pixel];
+    if (h.depth > MAX_DEPTH)
+    {
+        pixel += bkg_color * h.weight;
+        return;
+    }
+    const Object &object = *h.hit.object;
+    const Material &material = shading_material(object);
+    SurfaceShading surface = ShadeLocalT<Type, Features>(object, input, h.hit, h.ray, texture);
+    if constexpr (!reflective && !refractive)
+    {
+        pixel += surface.local * h.weight;
+        return;
+    }
+
+    auto reflect = [&](Real weight)
+    {
+        Ray reflection_ray(h.hit, Vec3::Reflect(h.ray.direction, surface.normal));
+        reflection_ray.cone_width = h.ray.FootprintAt(h.hit.t);
+        reflection_ray.cone_spread = h.ray.cone_spread;
+        QueueRay(out, reflection_ray, weight, h.pixel, h.depth + 1, bounds);
+    };
+    if constexpr (refractive)
+    {
+        Refraction refraction = Refract(surface.normal, surface.view_dir, material, h.ior_stack);
+        if (!refraction.valid)
+        {
+            return;
+        }
+        Real fresnel = refraction.fresnel;
+        if (refraction.total_internal)
+        {
+            // ShadeRayT returns the reflection alone here
+            if constexpr (reflective)
+            {
+                reflect(h.weight * material.k_specular * fresnel);
+                return;
+            }
+            pixel += surface.local * h.weight;
+            return;
+        }
+        pixel += surface.local * h.weight;
+        if constexpr (reflective)
+        {
+            reflect(h.weight * material.k_specular * fresnel);
+        }
+        Ray refraction_ray(h.hit, refraction.direction);
+        refraction_ray.cone_width = h.ray.FootprintAt(h.hit.t);
+        refraction_ray.cone_spread = h.ray.cone_spread;
+        std::vector<Real> ior_stack = std::move(h.ior_stack);
+        if (refraction.entering)
+        {
+            ior_stack.push_back(material.eta);
+        }
+        else
+        {
+            ior_stack.pop_back();
+        }
+        // like ShadeRayT, the refracted ray is shaded at the same hit again
+        out.hits.push_back({refraction_ray, h.hit, h.weight * fresnel * (1 - fresnel), h.pixel, h.depth + 1,
+                            std::move(ior_stack), HitKey(object, h.pixel)});
+        return;
+    }
+    pixel += surface.local * h.weight;
+    reflect(h.weight * material.k_specular);
+}
+
+using WavefrontShadeFunction = void (*)(WavefrontHit &, InputFileData &, const Texture *, const AABB &, WavefrontQueues &);
+
+template <ObjectType Type, unsigned... Features>
+constexpr std::array<WavefrontShadeFunction, SHADE_FEATURE_COUNT> MakeWavefrontTable(std::integer_sequence<unsigned, Features...>)
+{
+    return {&ShadeWavefrontT<Type, Features>...};
+}
+
+constexpr auto kSphereWavefrontShaders = MakeWavefrontTable<ObjectType::SPHERE>(std::make_integer_sequence<unsigned, SHADE_FEATURE_COUNT>());
+constexpr auto kFaceWavefrontShaders = MakeWavefrontTable<ObjectType::FACE>(std::make_integer_sequence<unsigned, SHADE_FEATURE_COUNT>());
+constexpr auto kInstanceWavefrontShaders = MakeWavefrontTable<ObjectType::INSTANCE>(std::make_integer_sequence<unsigned, SHADE_FEATURE_COUNT>());
+
+// whether clusters may have to be paged in, which is worth batching rays by cluster for
+static bool HasPackedMesh(const InputFileData &input)
+{
+    return std::any_of(input.meshes.begin(), input.meshes.end(), [](const auto &mesh)
+                       { return mesh.second->file != nullptr; });
+}
+
+// shade one hit of the trace of [x0, x1) x [y0, ...) through the shader of its object
+static void ShadeHit(WavefrontHit &h, InputFileData &input, int x0, int y0, int x1, const AABB &bounds, WavefrontQueues &out)
+{
+    const Object &object = *h.hit.object;
+    // holds the texture resident while this hit is shaded, even if the cache evicts it
+    std::shared_ptr<const Texture> texture;
+    if (object.texture_index != -1)
+    {
+        texture = TextureCache::Global().Acquire(input.texture[object.texture_index]);
+    }
+    const auto &table = object.type == ObjectType::SPHERE ? kSphereWavefrontShaders
+                        : object.type == ObjectType::FACE ? kFaceWavefrontShaders
+                                                            : kInstanceWavefrontShaders;
+    active_pixel = PixelKey(x0 + h.pixel % (x1 - x0), y0 + h.pixel / (x1 - x0));
+    table[object.shader_features](h, input, texture.get(), bounds, out);
+}
+
+// ShadeHit for every hit of a bounce, with the shadow rays of all of them answered together by
+// AnswerShadows. Each round shades the hits still missing answers into a scratch queue while
+// their shadow rays are recorded, keeps the output of those that asked for nothing new and
+// answers the rest. Whether more rays follow depends only on the answers to area light
+// samples, so most hits are done in the second round. Pixels are added to in hit order as
+// ShadeHit alone would.
+static void ShadeBatched(InputFileData &input, std::vector<WavefrontHit> &hits, int x0, int y0, int x1, const AABB &bounds,
+                         WavefrontQueues &out)
+{
+    std::vector<ShadowQueries> shadows(hits.size());
+    std::vector<Color> added(hits.size(), Color(0, 0, 0));
+    std::vector<int> open(hits.size());
+    for (int k = 0; k < (int)hits.size(); k++)
+    {
+        open[k] = k;
+    }
+    WavefrontQueues scratch;
+    scratch.pixels.assign(out.pixels.size(), Color(0, 0, 0));
+    while (!open.empty())
+    {
+        std::vector<int> still_open;
+        for (int k : open)
+        {
+            // shading moves the ior stack out of the hit
+            WavefrontHit h = hits[k];
+            size_t rays = scratch.rays.size(), queued_hits = scratch.hits.size();
+            scratch.pixels[h.pixel] = Color(0, 0, 0);
+            shadows[k].next = 0;
+            active_shadows = &shadows[k];
+            ShadeHit(h, input, x0, y0, x1, bounds, scratch);
+            active_shadows = nullptr;
+            if (!shadows[k].Complete())
+            {
+                scratch.rays.erase(scratch.rays.begin() + rays, scratch.rays.end());
+                scratch.hits.erase(scratch.hits.begin() + queued_hits, scratch.hits.end());
+                still_open.push_back(k);
+                continue;
+            }
+            added[k] = scratch.pixels[h.pixel];
+        }
+        AnswerShadows(input, shadows);
+        open.swap(still_open);
+    }
+    for (int k = 0; k < (int)hits.size(); k++)
+    {
+        out.pixels[hits[k].pixel] += added[k];
+    }
+    std::move(scratch.rays.begin(), scratch.rays.end(), std::back_inserter(out.rays));
+    std::move(scratch.hits.begin(), scratch.hits.end(), std::back_inserter(out.hits));
+}
+
+// trace the pixels [x0, x1) x [y0, y1) of `camera` breadth first into `pixels`, row by row
+void TraceWavefront(InputFileData &input, const Camera &camera, int x0, int y0, int x1, int y1, std::vector<Color> &pixels)
+{
+    AABB bounds = input.bvh.Bounds();
+    WavefrontQueues queues;
+    queues.pixels.assign((size_t)(x1 - x0) * (y1 - y0), Color(0, 0, 0));
+    for (int j = y0; j < y1; j++)
+    {
+        for (int i = x0; i < x1; i++)
+        {
+            QueueRay(queues, camera.PrimaryRay(i, j), 1, (j - y0) * (x1 - x0) + (i - x0), 1, bounds);
+        }
+    }
+    bool packed = HasPackedMesh(input);
+    std::vector<WavefrontRay> rays;
+    std::vector<WavefrontHit> hits;
+    std::vector<RayResult> batch_hits;
+    while (!queues.rays.empty() || !queues.hits.empty())
+    {
+        rays.swap(queues.rays);
+        hits.swap(queues.hits);
+        queues.rays.clear();
+        queues.hits.clear();
+
+        // intersect, as TraceRay does
+        std::sort(rays.begin(), rays.end(), [](const WavefrontRay &a, const WavefrontRay &b)
+                  { return a.key < b.key; });
+        if (packed)
+        {
+            IntersectBatch(input, rays, batch_hits);
+        }
+        for (size_t k = 0; k < rays.size(); k++)
+        {
+            WavefrontRay &r = rays[k];
+            if (r.depth >= MAX_DEPTH)
+            {
+                queues.pixels[r.pixel] += input.bkgcolor * r.weight;
+                continue;
+            }
+            RayResult hit = packed ? std::move(batch_hits[k]) : IntersectScene(r.ray, SceneBVH(input, r.depth));
+            if (hit.t < 0)
+            {
+                queues.pixels[r.pixel] += input.bkgcolor * r.weight;
+                continue;
+            }
+            hits.push_back({r.ray, hit, r.weight, r.pixel, r.depth, InitialIorStack(*hit.object, input),
+                            HitKey(*hit.object, r.pixel)});
+        }
+
+        // shade, queueing the next bounce
+        std::sort(hits.begin(), hits.end(), [](const WavefrontHit &a, const WavefrontHit &b)
+                  { return a.key < b.key; });
+        if (packed)
+        {
+            ShadeBatched(input, hits, x0, y0, x1, bounds, queues);
+        }
+        else
+        {
+            for (WavefrontHit &h : hits)
+            {
+                ShadeHit(h, input, x0, y0, x1, bounds, queues);
+            }
+        }
+        rays.clear();
+        hits.clear();
+    }
+    pixels = std::move(queues.pixels);
+}
+
+// RenderRegion traced breadth first, one tile per task. With packed meshes a task is a band of
+// rows, one per thread, since the larger a batch the fewer times each cluster is paged in.
+void RenderRegionWavefront(InputFileData &input, const Camera &camera, const Region &region, Image &image, ThreadPool &pool,
+                           TileStream *stream = nullptr)
+{
+    int tile_width = kTileSize, tile_height = kTileSize;
+    if (HasPackedMesh(input))
+    {
+        tile_width = std::max(region.Width(), 1);
+        tile_height = std::max((region.Height() + pool.Size() - 1) / pool.Size(), 1);
+    }
+    int tiles_x = (region.Width() + tile_width - 1) / tile_width;
+    int tiles_y = (region.Height() + tile_height - 1) / tile_height;
+    CullToView(input, camera, region);
+    pool.ParallelFor(tiles_x * tiles_y, [&](int tile)
+                     {
+        int tx0 = region.x0 + (tile % tiles_x) * tile_width;
+        int ty0 = region.y0 + (tile / tiles_x) * tile_height;
+        int tx1 = std::min(tx0 + tile_width, region.x1);
+        int ty1 = std::min(ty0 + tile_height, region.y1);
+        std::vector<Color> pixels;
+        TraceWavefront(input, camera, tx0, ty0, tx1, ty1, pixels);
+        TextureCache::Global().Unpin();
+        for (int j = ty0; j < ty1; j++)
+        {
+            for (int i = tx0; i < tx1; i++)
+            {
+                image.setPixel(i - region.x0, j - region.y0, pixels[(j - ty0) * (tx1 - tx0) + (i - tx0)]);
+            }
+        }
+        if (stream)
+        {
+            stream->Emit(image, tx0, ty0, tx1, ty1);
+        } });
+}
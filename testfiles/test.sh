@@ -2,6 +2,48 @@
 
 PROGRAM_NAME="../raytracer"
 
+# largest difference between corresponding values of two PPMs (the renderer writes P3 text);
+# a missing file or a different number of values counts as 256
+max_diff() {
+    [ -f "$1" ] && [ -f "$2" ] || { echo 256; return; }
+    awk 'NR == FNR { for (k = 1; k <= NF; k++) a[n++] = $k; next }
+         { for (k = 1; k <= NF; k++) { d = $k - a[m++]; if (d < 0) d = -d; if (d > max) max = d } }
+         END { print m == n ? max + 0 : 256 }' "$1" "$2"
+}
+# how many values of two PPMs differ by more than $3; every value if the files do not line up
+count_diff() {
+    [ -f "$1" ] && [ -f "$2" ] || { echo 999999999; return; }
+    awk -v tolerance="$3" 'NR == FNR { for (k = 1; k <= NF; k++) a[n++] = $k; next }
+         { for (k = 1; k <= NF; k++) { d = $k - a[m++]; if (d < 0) d = -d; if (d > tolerance) count++ } }
+         END { print m == n ? count + 0 : n }' "$1" "$2"
+}
+# pixels of a PPM brighter or darker than all four neighbours by more than 30 (summed over
+# the channels), i.e. the isolated speckle that rays re-hitting their own surface leave
+speckles() {
+    awk 'NR == 2 { w = $1; h = $2 } NR > 3 { l[NR - 4] = $1 + $2 + $3 }
+         END { for (y = 1; y < h - 1; y++) for (x = 1; x < w - 1; x++) {
+                   k = y * w + x; up = down = 0
+                   for (q = 0; q < 4; q++) {
+                       d = l[k] - l[k + (q == 0 ? -1 : q == 1 ? 1 : q == 2 ? -w : w)]
+                       if (d > 30) up++; if (d < -30) down++ }
+                   if (up == 4 || down == 4) count++ }
+               print count + 0 }' "$1"
+}
+# PPM $1 shrunk by the even factor $2: pixel (x, y) is the box of width $2 around pixel
+# ($2 x, $2 y), which is the one the camera puts at the same point of the image plane
+downsample() {
+    awk -v f="$2" 'NR == 2 { w = $1; h = $2 } NR > 3 { n = NR - 4; r[n] = $1; g[n] = $2; b[n] = $3 }
+         END { print "P3"; print w / f, h / f; print 255; m = f / 2
+               for (y = 0; y < h / f; y++) for (x = 0; x < w / f; x++) {
+                   sr = sg = sb = 0
+                   for (dy = -m; dy <= m; dy++) for (dx = -m; dx <= m; dx++) {
+                       weight = (dx == m || dx == -m ? 0.5 : 1) * (dy == m || dy == -m ? 0.5 : 1)
+                       i = f * x + dx; j = f * y + dy
+                       i = i < 0 ? 0 : i >= w ? w - 1 : i; j = j < 0 ? 0 : j >= h ? h - 1 : j
+                       sr += weight * r[j * w + i]; sg += weight * g[j * w + i]; sb += weight * b[j * w + i] }
+                   printf "%d %d %d\n", sr / (f * f) + 0.5, sg / (f * f) + 0.5, sb / (f * f) + 0.5 } }' "$1"
+}
+
 # echo "-------- Running Test1.txt --------"
 # $PROGRAM_NAME Test1.txt
 
@@ -22,3 +64,263 @@ $PROGRAM_NAME Test2.txt
 
 # echo "-------- Running TestE.txt --------"
 # $PROGRAM_NAME TestE.txt
+
+# geometry from 1e-3 to 1e6: no self-intersection speckle on the planet, contact shadows under the
+# spheres; offsetting ray origins by a fixed 1e-4 instead leaves over 400 speckles, this a handful
+echo "-------- Running TestScale.txt --------"
+$PROGRAM_NAME TestScale.txt
+[ "$(speckles TestScale.ppm)" -le 10 ] && echo "no self-intersection speckle"
+
+# a fixed number of pinned threads renders the same image
+$PROGRAM_NAME TestScale.txt --threads 3 --pin --stats -o TestScale_pinned.ppm
+cmp TestScale.ppm TestScale_pinned.ppm && echo "pinned image matches"
+
+# half a stop brighter, sRGB encoded and dithered on the way to 8 bits
+$PROGRAM_NAME TestScale.txt --exposure 0.5 --srgb --dither --stats -o TestScale_srgb.ppm
+
+# the same image as a deflate-compressed PNG, filtered and compressed in strips on the pool
+$PROGRAM_NAME TestScale.txt --threads 3 -o TestScale.png
+
+# tiles streamed through a pipe as they finish, reassembled by a second process
+$PROGRAM_NAME TestScale.txt --stream - | $PROGRAM_NAME --reassemble - -o TestScale_streamed.ppm
+cmp TestScale.ppm TestScale_streamed.ppm && echo "streamed image matches"
+
+# a reader that stops after 100 bytes: the renderer reports the closed stream and exits with
+# status 1 instead of being killed by SIGPIPE
+STATUS=$( { { $PROGRAM_NAME TestScale.txt --stream - 2>/dev/null; echo $? >&3; } | head -c 100 >/dev/null; } 3>&1 )
+[ "$STATUS" = 1 ] && echo "closed stream exits cleanly"
+
+# five cameras declared in one scene file, rendered in one run with the tiles of all of them
+# interleaved on the pool; the camera without fields of its own must match TestScale.ppm
+echo "-------- Running TestCameras.txt --------"
+$PROGRAM_NAME TestCameras.txt --stats
+cmp TestScale.ppm TestCameras_main.ppm && echo "main camera image matches"
+
+# four frames of TestScale.txt from one parse; frame 0 matches the single render above and
+# frame 3 matches a single render of the scene file edited to that frame's sphere, eye and light
+echo "-------- Running TestScale.txt --animate TestAnim.txt --------"
+$PROGRAM_NAME TestScale.txt --animate TestAnim.txt
+cmp TestScale.ppm TestScale_0000.ppm && echo "first animation frame matches"
+sed -e 's/^eye 0 0.004 0.03/eye 0.003 0.004 0.03/' \
+    -e 's/^sphere 0 0.001 0 0.001/sphere 0.003 0.001 0 0.001/' \
+    -e 's/^light 0.004 0.008 0.004 1 0.6 0.6 0.6/light 0.004 0.008 0.004 1 0.1 0.1 0.1/' \
+    TestScale.txt > TestFrame3.txt
+$PROGRAM_NAME TestFrame3.txt
+cmp TestFrame3.ppm TestScale_0003.ppm && echo "last animation frame matches"
+
+# one frame shared by three worker processes through lock files, then merged; the merge
+# must match TestScale.ppm above exactly
+echo "-------- Running TestScale.txt on 3 tile workers --------"
+rm -rf tiles && mkdir tiles
+$PROGRAM_NAME TestScale.txt --split tiles --tile-size 48
+$PROGRAM_NAME TestScale.txt --worker tiles &
+$PROGRAM_NAME TestScale.txt --worker tiles &
+$PROGRAM_NAME TestScale.txt --worker tiles &
+wait
+$PROGRAM_NAME --merge tiles -o TestScale_merged.ppm
+cmp TestScale.ppm TestScale_merged.ppm && echo "merged image matches"
+
+# first run saves the first hits; the second run only changes a light colour, so it shades
+# from TestScale.gbuf instead of tracing primary rays
+echo "-------- Running TestScale.txt with a G-buffer --------"
+rm -f TestScale.gbuf
+$PROGRAM_NAME TestScale.txt --gbuffer TestScale.gbuf -o TestScale_gbuf.ppm
+sed 's/^light 0.004 0.008 0.004 1 0.6 0.6 0.6/light 0.004 0.008 0.004 1 0.9 0.3 0.2/' TestScale.txt > TestRelit.txt
+$PROGRAM_NAME TestRelit.txt
+$PROGRAM_NAME TestRelit.txt --gbuffer TestScale.gbuf -o TestRelit_gbuf.ppm
+cmp TestRelit.ppm TestRelit_gbuf.ppm && echo "re-lit image matches"
+
+# render server session: the move only re-renders the tiles it can affect, and the result
+# must match a fresh render of the edited scene file
+echo "-------- Running TestScale.txt edits through a render server --------"
+rm -f TestScale.sock
+$PROGRAM_NAME TestScale.txt --serve TestScale.sock &
+SERVER=$!
+sleep 1
+$PROGRAM_NAME --client TestScale.sock -o TestScale_client.ppm
+$PROGRAM_NAME --client TestScale.sock --move 0 0.003 0 0 -o TestMoved_client.ppm
+kill $SERVER
+wait $SERVER
+sed 's/^sphere 0 0.001 0 0.001/sphere 0.003 0.001 0 0.001/' TestScale.txt > TestMoved.txt
+$PROGRAM_NAME TestMoved.txt
+cmp TestMoved.ppm TestMoved_client.ppm && echo "incremental image matches"
+
+# 400 ranged lights: the light grid only hands each point the lights near it; the second run
+# shades 8 of them per point, picked by estimated contribution
+echo "-------- Running TestLights.txt --------"
+$PROGRAM_NAME TestLights.txt
+$PROGRAM_NAME TestLights.txt --light-samples 8 -o TestLights_sampled.ppm
+
+# large blockers over a busy floor: --stats shows how many blocked shadow rays were answered
+# by the object that blocked the previous one
+echo "-------- Running TestShadows.txt --------"
+$PROGRAM_NAME TestShadows.txt --stats
+
+# a render server whose threads last saw the big sphere block the lights, below it; after an
+# edit makes the sphere translucent, its shadow must match a fresh render of the edited file
+rm -f TestShadows.sock
+$PROGRAM_NAME TestShadows.txt --serve TestShadows.sock &
+SERVER=$!
+sleep 1
+$PROGRAM_NAME --client TestShadows.sock --region 256 128 272 144 -o TestShadows_client.ppm
+$PROGRAM_NAME --client TestShadows.sock --mtlcolor 2 0.3 0.4 0.8 1 1 1 0.1 0.7 0.3 40 0.5 1 --region 256 128 272 144 \
+    -o TestTranslucent_client.ppm
+kill $SERVER
+wait $SERVER
+sed 's/^mtlcolor 0.3 0.4 0.8 1 1 1 0.1 0.7 0.3 40 1 1/mtlcolor 0.3 0.4 0.8 1 1 1 0.1 0.7 0.3 40 0.5 1/' TestShadows.txt > TestTranslucent.txt
+$PROGRAM_NAME TestTranslucent.txt --region 256 128 272 144
+cmp TestTranslucent.ppm TestTranslucent_client.ppm && echo "translucent occluder image matches"
+
+# soft shadows from a rectangular and a spherical area light; --area-samples sets the shadow
+# rays spent where a light is partly hidden
+echo "-------- Running TestArea.txt --------"
+$PROGRAM_NAME TestArea.txt
+
+# every sampled light and shadow ray is seeded from its pixel, never from the thread or the
+# order tiles finish in: 1, 4 and one thread per CPU give the same images bit for bit
+for THREADS in 1 4 $(nproc); do
+    $PROGRAM_NAME TestArea.txt --threads $THREADS -o TestArea_t$THREADS.ppm
+    $PROGRAM_NAME TestLights.txt --light-samples 8 --threads $THREADS -o TestLights_t$THREADS.ppm
+done
+cmp TestArea_t1.ppm TestArea_t4.ppm && cmp TestArea_t1.ppm TestArea_t$(nproc).ppm &&
+    cmp TestLights_t1.ppm TestLights_t4.ppm && cmp TestLights_t1.ppm TestLights_t$(nproc).ppm &&
+    echo "thread count independent images match"
+
+# reflection and refraction heavy: once per pixel and once one bounce at a time; the two
+# images match up to rounding
+echo "-------- Running TestMirrors.txt --------"
+$PROGRAM_NAME TestMirrors.txt
+$PROGRAM_NAME TestMirrors.txt --wavefront -o TestMirrors_wavefront.ppm
+[ "$(max_diff TestMirrors.ppm TestMirrors_wavefront.ppm)" -le 1 ] && echo "wavefront image matches up to rounding"
+
+# the unclamped framebuffer as 32-bit PFM and raw 16-bit half floats, highlights above 1 intact
+$PROGRAM_NAME TestMirrors.txt -o TestMirrors.pfm
+$PROGRAM_NAME TestMirrors.txt -o TestMirrors.half
+# the PFM header is little-endian 480x320, and its rows, stored bottom up, clamp and truncate
+# to exactly the bytes of TestMirrors.ppm; the half file is 6 bytes per pixel with no header
+[ "$(head -n 3 TestMirrors.pfm)" = "$(printf 'PF\n480 320\n-1.0')" ] &&
+    tail -c +17 TestMirrors.pfm | od -A n -v -t f4 | awk -v w=480 -v h=320 '
+        NR == FNR { for (k = 1; k <= NF; k++) f[n++] = $k; next }
+        FNR <= 3 { next }
+        { for (k = 1; k <= NF; k++) {
+              v = f[(h - 1 - int(m / (w * 3))) * w * 3 + m % (w * 3)]; v = v < 0 ? 0 : v > 1 ? 1 : v
+              if (int(v * 255) != $k) bad++; m++ } }
+        END { exit !(m == n && m == w * h * 3 && !bad) }' - TestMirrors.ppm &&
+    echo "float map matches"
+[ "$(wc -c < TestMirrors.half)" -eq $((480 * 320 * 6)) ] && echo "half floats have the image size"
+
+# a field of spheres around the camera: primary rays only traverse the ones in the view
+# frustum while the mirror still shows the rest; the image must match one rendered without
+# culling, which would show any sphere wrongly culled, and so must the tighter frustums of
+# small tiles
+echo "-------- Running TestCull.txt --------"
+$PROGRAM_NAME TestCull.txt --stats
+$PROGRAM_NAME TestCull.txt --no-cull -o TestCull_unculled.ppm
+cmp TestCull.ppm TestCull_unculled.ppm && echo "culled image matches unculled"
+rm -rf cull_tiles && mkdir cull_tiles
+$PROGRAM_NAME TestCull.txt --split cull_tiles --tile-size 40
+$PROGRAM_NAME TestCull.txt --worker cull_tiles
+$PROGRAM_NAME --merge cull_tiles -o TestCull_merged.ppm
+cmp TestCull.ppm TestCull_merged.ppm && echo "culled tiles match"
+
+# three frames with the same spheres in view: the culled BVH is built for the first and only
+# refit for the others, and the last frame matches a render of the scene with the mirror moved
+$PROGRAM_NAME TestCull.txt --animate TestCullAnim.txt --stats > TestCull_anim_stats.txt
+grep -q ", 1 BVH builds, 2 refits" TestCull_anim_stats.txt && echo "culled BVH refit across frames"
+sed 's/^sphere 0 1.5 -6 1.2/sphere 0.4 1.5 -6 1.2/' TestCull.txt > TestCullMoved.txt
+$PROGRAM_NAME TestCullMoved.txt
+cmp TestCullMoved.ppm TestCull_0002.ppm && echo "refit culled frame matches"
+
+# a minified texture: trilinear lookups in the mip pyramid stay within a quarter of the range
+# of a render at 8 times the size box filtered down (sampling level 0 alone misses it by up to
+# 103), and the image does not depend on the thread count
+echo "-------- Running TestMip.txt --------"
+$PROGRAM_NAME TestMip.txt
+sed 's/^imsize 32 32/imsize 256 256/' TestMip.txt > TestMipLarge.txt
+$PROGRAM_NAME TestMipLarge.txt
+downsample TestMipLarge.ppm 8 > TestMip_reference.ppm
+[ "$(max_diff TestMip.ppm TestMip_reference.ppm)" -le 64 ] && echo "minified texture close to supersampled"
+$PROGRAM_NAME TestMip.txt --threads 3 -o TestMip_threads.ppm
+cmp TestMip.ppm TestMip_threads.ppm && echo "minified texture deterministic"
+
+# three 1.4 MB textures, each shared by three objects: a 3 MB budget keeps two of them, so
+# tiles that reach the third evict one, while three threads sample and evict concurrently;
+# reloading decodes the same texels, so the image must match the unbudgeted render
+echo "-------- Running TestTextures.txt --------"
+awk 'NR == 1 { print; next } { for (k = 1; k + 2 <= NF; k += 3) printf "%d %d %d ", $k, $(k + 1) * 0.6, $(k + 2) * 0.3; print "" }' soccerball.ppm > TestTexture_warm.ppm
+awk 'NR == 1 { print; next } { for (k = 1; k + 2 <= NF; k += 3) printf "%d %d %d ", $k * 0.3, $(k + 1) * 0.6, $(k + 2); print "" }' soccerball.ppm > TestTexture_cool.ppm
+$PROGRAM_NAME TestTextures.txt
+$PROGRAM_NAME TestTextures.txt --texture-budget 3 --threads 3 --stats -o TestTextures_budget.ppm > TestTextures_stats.txt
+awk '/^textures:/ && $6 > 0 { found = 1 } END { exit !found }' TestTextures_stats.txt &&
+    cmp TestTextures.ppm TestTextures_budget.ppm && echo "budgeted textures match"
+
+# two meshes defined once and placed 330 times with their own transforms and materials
+echo "-------- Running TestInstances.txt --------"
+$PROGRAM_NAME TestInstances.txt
+
+# the same textured and untextured faces inline and as a mesh placed once with no transform,
+# both shadowing the floor
+echo "-------- Running TestInstanceInline.txt inline and as one instance --------"
+$PROGRAM_NAME TestInstanceInline.txt
+awk '/^mtlcolor/ && ++materials == 2 { print "mesh shapes" } { print }
+     END { print "endmesh"; print "instance shapes" }' TestInstanceInline.txt > TestInstanceOnce.txt
+$PROGRAM_NAME TestInstanceOnce.txt
+cmp TestInstanceInline.ppm TestInstanceOnce.ppm && echo "untransformed instance matches inline faces"
+
+# the ball mesh packed on disk, a single cluster, and read back; the image must match the
+# in-memory mesh
+echo "-------- Running TestInstances.txt from a packed mesh --------"
+$PROGRAM_NAME TestInstances.txt --pack-mesh ball TestBall.mesh
+awk '/^mesh ball/ { skip = 1; print "meshfile ball TestBall.mesh"; next }
+     skip && /^endmesh/ { skip = 0; next }
+     skip && /^(f|mtlcolor) / { next }
+     { print }' TestInstances.txt > TestPacked.txt
+$PROGRAM_NAME TestPacked.txt --geometry-budget 0.01 --stats
+cmp TestInstances.ppm TestPacked.ppm && echo "packed mesh image matches"
+
+# a 2304-triangle torus packed into 16 clusters and read back under a budget smaller than the
+# mesh, so clusters are paged in on demand and evicted again; per pixel and one bounce at a
+# time both must match the in-memory mesh. Per pixel, rays page clusters in as they happen to
+# reach them. One bounce at a time, the rays and then the shadow rays of a bounce are
+# intersected cluster by cluster, so each cluster is loaded at most once per batch: twice in
+# all for a matte torus, and at most twice per bounce with its reflections.
+echo "-------- Running TestClusters.txt from a packed mesh --------"
+$PROGRAM_NAME TestClusters.txt
+$PROGRAM_NAME TestClusters.txt --pack-mesh torus TestTorus.mesh
+awk '/^mesh torus/ { skip = 1; print "meshfile torus TestTorus.mesh"; next }
+     skip && /^endmesh/ { skip = 0; next }
+     skip && /^(f|mtlcolor) / { next }
+     { print }' TestClusters.txt > TestClustersPacked.txt
+$PROGRAM_NAME TestClustersPacked.txt --geometry-budget 0.1 --stats > TestClusters_stats.txt
+cat TestClusters_stats.txt
+$PROGRAM_NAME TestClustersPacked.txt --geometry-budget 0.1 --wavefront --threads 1 --stats -o TestClusters_wavefront.ppm \
+    > TestClusters_wavefront_stats.txt
+cat TestClusters_wavefront_stats.txt
+cmp TestClusters.ppm TestClustersPacked.ppm && cmp TestClusters.ppm TestClusters_wavefront.ppm &&
+    awk '/^geometry:/ && $2 > 1 && $6 > 0 { paged = 1 } END { exit !paged }' TestClusters_stats.txt &&
+    awk '/^geometry:/ && $4 <= 2 * 10 * $2 { batched = 1 } END { exit !batched }' TestClusters_wavefront_stats.txt &&
+    echo "paged clusters match"
+sed 's/^instance .*/& mtlcolor 0.3 0.7 0.4 1 1 1 0.1 0.8 0 40 1 1/' TestClustersPacked.txt > TestClustersMatte.txt
+$PROGRAM_NAME TestClustersMatte.txt --geometry-budget 0.1
+$PROGRAM_NAME TestClustersMatte.txt --geometry-budget 0.1 --wavefront --threads 1 --stats -o TestClustersMatte_wavefront.ppm \
+    > TestClustersMatte_stats.txt
+cat TestClustersMatte_stats.txt
+cmp TestClustersMatte.ppm TestClustersMatte_wavefront.ppm &&
+    awk '/^geometry:/ && $4 <= 2 * $2 { batched = 1 } END { exit !batched }' TestClustersMatte_stats.txt &&
+    echo "each cluster loaded once per batch"
+
+# the same mesh with 16-bit positions, octahedral normals and 16-bit texture coordinates:
+# about half the file size and a fifth of the resident memory, close to but not exactly the
+# float image: shading moves by a rounding step, and only a few silhouette and crack values
+# (of 460800) by more than 2
+$PROGRAM_NAME TestInstances.txt --pack-mesh ball TestBall16.mesh --pack-bits 16
+sed 's/TestBall.mesh/TestBall16.mesh/' TestPacked.txt > TestPacked16.txt
+$PROGRAM_NAME TestPacked16.txt --stats
+[ "$(count_diff TestInstances.ppm TestPacked16.ppm 2)" -le 100 ] && echo "16-bit packed mesh image is close"
+
+# 32-bit positions, with normals and texture coordinates encoded as above, so held to the
+# same bound
+$PROGRAM_NAME TestInstances.txt --pack-mesh ball TestBall32.mesh --pack-bits 32
+sed 's/TestBall.mesh/TestBall32.mesh/' TestPacked.txt > TestPacked32.txt
+$PROGRAM_NAME TestPacked32.txt
+[ "$(count_diff TestInstances.ppm TestPacked32.ppm 2)" -le 100 ] && echo "32-bit packed mesh image is close"